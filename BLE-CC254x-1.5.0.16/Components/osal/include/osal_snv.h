@@ -125,6 +125,35 @@ extern uint8 osal_snv_read( osalSnvId_t id, osalSnvLen_t len, void *pBuf);
  */
 extern uint8 osal_snv_write( osalSnvId_t id, osalSnvLen_t len, void *pBuf);
 
+/*********************************************************************
+ * @fn      osal_snv_read_at
+ *
+ * @brief   Read part of a data item from NV.
+ *
+ * @param   id     - Valid NV item Id.
+ * @param   offset - Offset of the data in the item.
+ * @param   len    - Length of data to read.
+ * @param   *pBuf  - Data is read into this buffer.
+ *
+ * @return  SUCCESS if successful.
+ *          Otherwise, NV_OPER_FAILED for failure.
+ */
+extern uint8 osal_snv_read_at( osalSnvId_t id, osalSnvLen_t offset, osalSnvLen_t len, void *pBuf);
+
+/*********************************************************************
+ * @fn      osal_snv_update
+ *
+ * @brief   Change part of a data item in NV.
+ *
+ * @param   id     - Valid NV item Id.
+ * @param   offset - Offset of the data in the item.
+ * @param   len    - Length of data to write.
+ * @param   *pBuf  - Data to write.
+ *
+ * @return  SUCCESS if successful, NV_OPER_FAILED if failed.
+ */
+extern uint8 osal_snv_update( osalSnvId_t id, osalSnvLen_t offset, osalSnvLen_t len, void *pBuf);
+
 /*********************************************************************
  * @fn      osal_snv_compact
  *
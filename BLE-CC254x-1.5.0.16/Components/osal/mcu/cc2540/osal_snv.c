@@ -180,6 +180,9 @@ static uint16 pgOff;
 // another write or erase.
 static uint8 failF;
 
+// aligned length of the item findItem() found last
+static uint16 findLen;
+
 /*********************************************************************
  * LOCAL FUNCTIONS
  */
@@ -193,6 +196,8 @@ static void   cleanErasedPage( uint8 pg );
 static void   findOffset( void );
 static void   compactPage( uint8 pg );
 
+static void   beginItem( uint8 pg, uint16 offset, uint16 alignedLen );
+static void   endItem( uint8 pg, uint16 offset, osalSnvId_t id, uint16 alignedLen );
 static void   writeWord( uint8 pg, uint16 offset, uint8 *pBuf );
 static void   writeWordM( uint8 pg, uint16 offset, uint8 *pBuf, osalSnvLen_t cnt );
 
@@ -461,7 +466,8 @@ static void findOffset(void)
  *                     offset.
  * @param   id       - NV item ID to search for
  *
- * @return  offset of the item, 0 when not found
+ * @return  offset of the item, 0 when not found. The item's aligned
+ *          length is left in findLen.
  */
 static uint16 findItem(uint8 pg, uint16 offset, osalSnvId_t id)
 {
@@ -508,7 +514,9 @@ static uint16 findItem(uint8 pg, uint16 offset, osalSnvId_t id)
     {
       // item found
       // length field could be corrupt. Mask invalid length mark.
-      uint8 len = hdr.len & ~OSAL_NV_INVALID_LEN_MARK;
+      // An item of 253 bytes or more takes 256 aligned.
+      uint16 len = hdr.len & ~OSAL_NV_INVALID_LEN_MARK;
+      findLen = len;
       return offset - len;
     }
     else if (hdr.len & OSAL_NV_INVALID_LEN_MARK)
@@ -551,6 +559,28 @@ static uint16 findItem(uint8 pg, uint16 offset, osalSnvId_t id)
  * @return  none
  */
 static void writeItem( uint8 pg, uint16 offset, osalSnvId_t id, uint16 alignedLen, uint8 *pBuf )
+{
+  beginItem(pg, offset, alignedLen);
+
+  // Copy over the data
+  writeWordM(pg, offset, pBuf, alignedLen / OSAL_NV_WORD_SIZE);
+
+  endItem(pg, offset, id, alignedLen);
+}
+
+/*********************************************************************
+ * @fn      beginItem
+ *
+ * @brief   Write the length of a new data item, ahead of its data.
+ *
+ * @param   pg     - Page number
+ * @param   offset - offset within the NV page where to write the new item
+ * @param   alignedLen - Length of the item's data, alinged in flash word
+ *                       boundary
+ *
+ * @return  none
+ */
+static void beginItem( uint8 pg, uint16 offset, uint16 alignedLen )
 {
   osalNvItemHdr_t hdr;
 
@@ -563,9 +593,27 @@ static void writeItem( uint8 pg, uint16 offset, osalSnvId_t id, uint16 alignedLe
   // remove invalid len mark
   hdr.len &= ~OSAL_NV_INVALID_LEN_MARK;
   writeWord(pg, offset + alignedLen, (uint8 *) &hdr);
+}
 
-  // Copy over the data
-  writeWordM(pg, offset, pBuf, alignedLen / OSAL_NV_WORD_SIZE);
+/*********************************************************************
+ * @fn      endItem
+ *
+ * @brief   Write the id of a new data item, once all its data is written,
+ *          which makes the item valid.
+ *
+ * @param   pg     - Page number
+ * @param   offset - offset within the NV page where the new item is
+ * @param   id     - NV item ID
+ * @param   alignedLen - Length of the item's data, alinged in flash word
+ *                       boundary
+ *
+ * @return  none
+ */
+static void endItem( uint8 pg, uint16 offset, osalSnvId_t id, uint16 alignedLen )
+{
+  osalNvItemHdr_t hdr;
+
+  hdr.len = alignedLen;
 
   // value is valid. Write header except for the most significant bit.
   hdr.id = id | OSAL_NV_INVALID_ID_MARK;
@@ -927,6 +975,111 @@ uint8 osal_snv_read( osalSnvId_t id, osalSnvLen_t len, void *pBuf )
   return NV_OPER_FAILED;
 }
 
+/*********************************************************************
+ * @fn      osal_snv_read_at
+ *
+ * @brief   Read part of a data item from NV, straight into the buffer.
+ *
+ * @param   id     - Valid NV item Id.
+ * @param   offset - Offset of the data in the item.
+ * @param   len    - Length of data to read.
+ * @param   *pBuf  - Data is read into this buffer.
+ *
+ * @return  SUCCESS if successful.
+ *          Otherwise, NV_OPER_FAILED for failure, or when the data is
+ *          not all within the item.
+ */
+uint8 osal_snv_read_at( osalSnvId_t id, osalSnvLen_t offset, osalSnvLen_t len, void *pBuf )
+{
+  uint16 itemOff = findItem(activePg, pgOff, id);
+
+  if (itemOff != 0 && (uint16)offset + len <= findLen)
+  {
+    HalFlashRead(activePg, itemOff + offset, pBuf, len);
+    return SUCCESS;
+  }
+  return NV_OPER_FAILED;
+}
+
+/*********************************************************************
+ * @fn      osal_snv_update
+ *
+ * @brief   Change part of a data item in NV. The item is written anew,
+ *          copying the rest of its data over from the old item one flash
+ *          word at a time, so no buffer for all of it is needed.
+ *
+ * @param   id     - Valid NV item Id.
+ * @param   offset - Offset of the data in the item.
+ * @param   len    - Length of data to write.
+ * @param   *pBuf  - Data to write.
+ *
+ * @return  SUCCESS if successful, NV_OPER_FAILED if failed or when the
+ *          data is not all within the item.
+ */
+uint8 osal_snv_update( osalSnvId_t id, osalSnvLen_t offset, osalSnvLen_t len, void *pBuf )
+{
+  uint16 srcOff = findItem(activePg, pgOff, id);
+  uint16 alignedLen = findLen;
+  uint8 tmp[OSAL_NV_WORD_SIZE];
+  uint16 i;
+
+  if (srcOff == 0 || (uint16)offset + len > alignedLen)
+  {
+    return NV_OPER_FAILED;
+  }
+
+  for (i = 0; i < len; i++)
+  {
+    HalFlashRead(activePg, srcOff + offset + i, tmp, 1);
+    if (tmp[0] != ((uint8 *)pBuf)[i])
+    {
+      break;
+    }
+  }
+
+  if (i == len)
+  {
+    // Changed value is the same value as before.
+    return SUCCESS;
+  }
+
+  if ( pgOff + alignedLen + OSAL_NV_WORD_SIZE > OSAL_NV_PAGE_SIZE )
+  {
+    setXferPage();
+    compactPage(activePg);
+
+    // The old item moved along with the others
+    srcOff = findItem(activePg, pgOff, id);
+  }
+
+  beginItem(activePg, pgOff, alignedLen);
+
+  for (i = 0; i < alignedLen; i += OSAL_NV_WORD_SIZE)
+  {
+    uint8 j;
+
+    HalFlashRead(activePg, srcOff + i, tmp, OSAL_NV_WORD_SIZE);
+    for (j = 0; j < OSAL_NV_WORD_SIZE; j++)
+    {
+      if (i + j >= offset && i + j < (uint16)offset + len)
+      {
+        tmp[j] = ((uint8 *)pBuf)[i + j - offset];
+      }
+    }
+    writeWord(activePg, pgOff + i, tmp);
+  }
+
+  endItem(activePg, pgOff, id, alignedLen);
+  if (failF)
+  {
+    return NV_OPER_FAILED;
+  }
+
+  pgOff += alignedLen + OSAL_NV_WORD_SIZE;
+
+  return SUCCESS;
+}
+
 /*********************************************************************
  * @fn      osal_snv_compact
  *
@@ -152,6 +152,7 @@
  * GLOBAL VARIABLES
  */
 uint8 blueBasic_TaskID;   // Task ID for internal task/event processing
+uint8 blueBasic_FlashstoreTaskID; // Task ID for background flash compaction
 
 /*********************************************************************
  * EXTERNAL VARIABLES
@@ -262,6 +263,49 @@ static CONST uint8 consoleAdvert[] =
 
 #endif
 
+#if ENABLE_EXPORT
+// Log export: writing <file letter>[<first record:2>[<count:2>]] to the range
+// characteristic streams those records out of the data characteristic
+static CONST uint8 exportProfileServUUID[] = { 0x64, 0xB8, 0x38, 0xEE, 0x40, 0x6E, 0xE4, 0xF3, 0x94, 0x46, 0x92, 0x15, 0xA4, 0x6F, 0xE3, 0x8F };
+static CONST gattAttrType_t exportProfileService = { ATT_UUID_SIZE, exportProfileServUUID };
+static CONST uint8 exportRangeUUID[] = { 0xDD, 0x0D, 0xCE, 0xA9, 0x2C, 0x07, 0xF6, 0x3E, 0xC4, 0x32, 0x6E, 0xE9, 0x7A, 0xC4, 0x05, 0xA5 };
+static CONST uint8 exportRangeProps = GATT_PROP_WRITE;
+static CONST uint8 exportDataUUID[] = { 0x9B, 0x7E, 0xE4, 0x1C, 0x7E, 0xDF, 0xBA, 0x28, 0x37, 0xA0, 0x45, 0xD2, 0x79, 0xCA, 0x46, 0x7E };
+static CONST uint8 exportDataProps = GATT_PROP_NOTIFY;
+static gattCharCfg_t *exportProfileCharCfg = NULL;
+static uint8 exportData;  // only tells GATTServApp_ProcessCharCfg which characteristic
+static uint8 exportRead;  // set when a chunk was read for a notification
+static CONST unsigned char exportRangeDesc[] = "Export range";
+static CONST unsigned char exportDataDesc[] = "Export data";
+
+// Milliseconds to wait for the stack to send the notifications it holds
+#define EXPORT_RETRY_MS 10
+
+static gattAttribute_t exportProfile[] =
+{
+  // Primary Service
+  { { ATT_BT_UUID_SIZE, primaryServiceUUID },   MY_GATT_PERMIT_READ,   0, (uint8*)&exportProfileService },
+  // Export Range Characteristic
+  { { ATT_BT_UUID_SIZE, characterUUID },        MY_GATT_PERMIT_READ,   0, (uint8*)&exportRangeProps },
+  { { ATT_UUID_SIZE, exportRangeUUID },         MY_GATT_PERMIT_WRITE,  0, NULL },
+  { { ATT_BT_UUID_SIZE, charUserDescUUID },     MY_GATT_PERMIT_READ,   0, (uint8*)exportRangeDesc },
+  // Export Data Characteristic
+  { { ATT_BT_UUID_SIZE, characterUUID },        MY_GATT_PERMIT_READ,   0, (uint8*)&exportDataProps },
+  { { ATT_UUID_SIZE, exportDataUUID },          0,                     0, &exportData },
+  { { ATT_BT_UUID_SIZE, clientCharCfgUUID },    MY_GATT_PERMIT_RW,     0, (uint8*)&exportProfileCharCfg },
+  { { ATT_BT_UUID_SIZE, charUserDescUUID },     MY_GATT_PERMIT_READ,   0, (uint8*)exportDataDesc },
+};
+
+static bStatus_t exportProfile_ReadAttrCB(uint16 connHandle, gattAttribute_t *pAttr, uint8 *pValue, uint8 *pLen, uint16 offset, uint8 maxLen, uint8 method);
+static bStatus_t exportProfile_WriteAttrCB(uint16 connHandle, gattAttribute_t *pAttr, uint8 *pValue, uint8 len, uint16 offset, uint8 method);
+static CONST gattServiceCBs_t exportProfileCB =
+{
+  exportProfile_ReadAttrCB,
+  exportProfile_WriteAttrCB,
+  NULL
+};
+#endif
+
 #if ENABLE_FAKE_OAD_PROFILE
 
 static CONST uint8 oadProfileServiceUUID[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xB0, 0x00, 0x40, 0x51, 0x04, 0xC0, 0xFF, 0x00, 0xF0 };
@@ -558,6 +602,17 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
                                   GATT_MAX_ENCRYPT_KEY_SIZE, NULL);    
 #endif
 
+#if ENABLE_EXPORT
+    exportProfileCharCfg = (gattCharCfg_t *)osal_mem_alloc( sizeof(gattCharCfg_t)
+                                                           * linkDBNumConns);
+    if (exportProfileCharCfg != NULL)
+    {
+      GATTServApp_InitCharCfg(INVALID_CONNHANDLE, exportProfileCharCfg);
+      GATTServApp_RegisterService(exportProfile, GATT_NUM_ATTRS(exportProfile),
+                                  GATT_MAX_ENCRYPT_KEY_SIZE, &exportProfileCB);
+    }
+#endif
+
     // Start Interpreter
     if (!interpreter_setup()) 
     {
@@ -640,7 +695,7 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
     {
       unsigned short ln = bluebasic_yield_linenum;
       bluebasic_yield_linenum = 0;
-      interpreter_run(ln, INTERPRETER_CAN_YIELD);
+      interpreter_run(ln, INTERPRETER_CAN_YIELD | INTERPRETER_SOURCE(SLICE_RESUME));
       SEMAPHORE_YIELD_SIGNAL();
     }
   
@@ -659,7 +714,7 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
     {
       if (blueBasic_interrupts[i].linenum && (events & (BLUEBASIC_EVENT_INTERRUPT << i)))
       {
-        interpreter_run(blueBasic_interrupts[i].linenum, INTERPRETER_CAN_RETURN | INTERPRETER_CAN_YIELD);
+        interpreter_run(blueBasic_interrupts[i].linenum, INTERPRETER_CAN_RETURN | INTERPRETER_CAN_YIELD | INTERPRETER_SOURCE(SLICE_INTERRUPT));
       }
     }
     SEMAPHORE_YIELD_SIGNAL();
@@ -680,7 +735,7 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
       done |= (BLUEBASIC_EVENT_TIMER<<i);
       if ( blueBasic_timers[i].linenum && (events & (BLUEBASIC_EVENT_TIMER<<i)))
       {
-        interpreter_run(blueBasic_timers[i].linenum, i == DELAY_TIMER ? 0 : INTERPRETER_CAN_RETURN | INTERPRETER_CAN_YIELD);
+        interpreter_run(blueBasic_timers[i].linenum, INTERPRETER_SOURCE(SLICE_TIMER + i) | (i == DELAY_TIMER ? 0 : INTERPRETER_CAN_RETURN | INTERPRETER_CAN_YIELD));
 #if ENABLE_YIELD          
         if (bluebasic_yield_linenum)
         {
@@ -729,7 +784,7 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
               {
                 serial[i].sbuf_read_pos = 0;
                 if (serial[i].onread)
-                  interpreter_run(serial[i].onread, INTERPRETER_CAN_RETURN);
+                  interpreter_run(serial[i].onread, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_SERIAL));
               }
             }
           }
@@ -742,7 +797,7 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
           process_mppt(i, len);
 #endif        
           if (serial[i].sbuf_read_pos == 0 && serial[i].onread)
-            interpreter_run(serial[i].onread, INTERPRETER_CAN_RETURN);
+            interpreter_run(serial[i].onread, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_SERIAL));
           break;
 #endif
 #if defined(PROCESS_RAPID)
@@ -751,7 +806,7 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
           process_rapid(i, len);
 #endif
           if (serial[i].sbuf_read_pos == 0 && serial[i].onread)
-            interpreter_run(serial[i].onread, INTERPRETER_CAN_RETURN);
+            interpreter_run(serial[i].onread, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_SERIAL));
           break;
 #endif          
 #if defined(PROCESS_SERIAL_DATA) || defined(PROCESS_MPPT)          
@@ -781,7 +836,7 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
               }
             }           
             if (serial[i].onread /*&& serial[i].sbuf_read_pos != 16*/)
-              interpreter_run(serial[i].onread, INTERPRETER_CAN_RETURN);    
+              interpreter_run(serial[i].onread, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_SERIAL));    
           }
  #if defined(PROCESS_SERIAL_DATA) || defined(PROCESS_MPPT)   
           break;
@@ -799,12 +854,12 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
   {
     if (i2c[0].onread && i2c[0].available_bytes)
     {
-      interpreter_run(i2c[0].onread, INTERPRETER_CAN_RETURN);
+      interpreter_run(i2c[0].onread, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_I2C));
     }
     // when read buffer is empty it must have been a write...
     if (i2c[0].onwrite && i2c[0].available_bytes == 0)
     {
-      interpreter_run(i2c[0].onwrite, INTERPRETER_CAN_RETURN);
+      interpreter_run(i2c[0].onwrite, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_I2C));
     }
     SEMAPHORE_YIELD_SIGNAL();
     return (events ^ BLUEBASIC_EVENT_I2C);
@@ -816,6 +871,97 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
   return 0;
 }
 
+/*********************************************************************
+ * @fn      BlueBasic_FlashstoreInit
+ *
+ * @brief   Initialization function for the flashstore task, which
+ *          compacts the flash in the background and writes out file
+ *          buffers which timed out. It is the last task so it only
+ *          runs when no other task has anything to do.
+ *
+ * @param   task_id - the ID assigned by OSAL.
+ *
+ * @return  none
+ */
+void BlueBasic_FlashstoreInit( uint8 task_id )
+{
+  blueBasic_FlashstoreTaskID = task_id;
+}
+
+/*********************************************************************
+ * @fn      BlueBasic_FlashstoreProcessEvent
+ *
+ * @brief   Flashstore task event processor. Takes one compaction step
+ *          each time round, leaving the event set while there is more
+ *          to do so the rest of the system runs in between.
+ *
+ * @param   task_id  - The OSAL assigned task ID.
+ * @param   events - events to process.
+ *
+ * @return  events not processed
+ */
+uint16 BlueBasic_FlashstoreProcessEvent( uint8 task_id, uint16 events )
+{
+  VOID task_id; // OSAL required parameter that isn't used in this function
+
+#if FLASHSTORE_COMPACT_STEP
+  if ( events & FLASHSTORE_EVENT_COMPACT )
+  {
+    if ( flashstore_compact_step() )
+    {
+      return events;
+    }
+    return (events ^ FLASHSTORE_EVENT_COMPACT);
+  }
+#endif
+
+#if FS_WRITE_BUFFER
+  if ( events & FLASHSTORE_EVENT_FLUSH )
+  {
+    // Try again shortly if the interpreter was busy
+    if ( interpreter_flush_files() )
+    {
+      OS_flashstore_flush_after(10);
+    }
+    return (events ^ FLASHSTORE_EVENT_FLUSH);
+  }
+#endif
+
+#if ENABLE_EXPORT
+  if ( events & FLASHSTORE_EVENT_EXPORT )
+  {
+    // Notify chunks of the stream until the stack can't take any more
+    while (interpreter_export_more())
+    {
+      exportRead = 0;
+      if (GATTServApp_ProcessCharCfg(exportProfileCharCfg, &exportData,
+                                     FALSE, exportProfile,
+                                     GATT_NUM_ATTRS(exportProfile), INVALID_TASK_ID,
+                                     exportProfile_ReadAttrCB) != SUCCESS)
+      {
+        // The chunk read wasn't sent, so it goes again later
+        if (exportRead)
+        {
+          interpreter_export_rewind();
+        }
+        osal_start_timerEx(blueBasic_FlashstoreTaskID, FLASHSTORE_EVENT_EXPORT, EXPORT_RETRY_MS);
+        return (events ^ FLASHSTORE_EVENT_EXPORT);
+      }
+      if (!exportRead)
+      {
+        // Nobody has notifications enabled
+        break;
+      }
+    }
+    interpreter_export(0, 0, 0);
+    return (events ^ FLASHSTORE_EVENT_EXPORT);
+  }
+#endif
+
+  // Discard unknown events
+  return 0;
+}
+
 static void blueBasic_HandleConnStatusCB(uint16 connHandle, uint8 changeType)
 {
   if (connHandle == LOOPBACK_CONNHANDLE)
@@ -837,6 +983,14 @@ static void blueBasic_HandleConnStatusCB(uint16 connHandle, uint8 changeType)
     ble_console_enabled = 0;
   done:;
   }
+#endif
+#if ENABLE_EXPORT
+  if (exportProfileCharCfg != NULL &&
+      (changeType == LINKDB_STATUS_UPDATE_REMOVED || (changeType == LINKDB_STATUS_UPDATE_STATEFLAGS && !linkDB_Up(connHandle))))
+  {
+    GATTServApp_InitCharCfg(connHandle, exportProfileCharCfg);
+    interpreter_export(0, 0, 0);
+  }
 #endif
   ble_connection_status(connHandle, changeType, 0);
 }
@@ -1104,6 +1258,45 @@ done:
 
 #endif //ENABLE_BLE_CONSOLE
 
+#if ENABLE_EXPORT
+
+static bStatus_t exportProfile_ReadAttrCB(uint16 connHandle, gattAttribute_t *pAttr, uint8 *pValue, uint8 *pLen, uint16 offset, uint8 maxLen, uint8 method)
+{
+  // Only reached through GATTServApp_ProcessCharCfg, the data can't be read
+  *pLen = interpreter_export_read(pValue, maxLen);
+  exportRead = 1;
+  return SUCCESS;
+}
+
+static bStatus_t exportProfile_WriteAttrCB(uint16 connHandle, gattAttribute_t *pAttr, uint8 *pValue, uint8 len, uint16 offset, uint8 method)
+{
+  if (pAttr->type.len == ATT_BT_UUID_SIZE)
+  {
+    // The data's Client Characteristic Configuration
+    return GATTServApp_ProcessCCCWriteReq( connHandle, pAttr, pValue, len,
+                                           offset, GATT_CLIENT_CFG_NOTIFY );
+  }
+  if (offset)
+  {
+    return ATT_ERR_ATTR_NOT_LONG;
+  }
+  if (len != 1 && len != 3 && len != 5)
+  {
+    return ATT_ERR_INVALID_VALUE_SIZE;
+  }
+  // Anything but a file letter just stops the export
+  if (!interpreter_export(pValue[0],
+                          len > 1 ? BUILD_UINT16(pValue[1], pValue[2]) : 0,
+                          len > 3 ? BUILD_UINT16(pValue[3], pValue[4]) : 0))
+  {
+    return pValue[0] >= 'A' && pValue[0] <= 'Z' ? ATT_ERR_INSUFFICIENT_RESOURCES : SUCCESS;
+  }
+  osal_set_event( blueBasic_FlashstoreTaskID, FLASHSTORE_EVENT_EXPORT );
+  return SUCCESS;
+}
+
+#endif // ENABLE_EXPORT
+
 HAL_ISR_FUNCTION(port0Isr, P0INT_VECTOR)
 {
   unsigned char status;
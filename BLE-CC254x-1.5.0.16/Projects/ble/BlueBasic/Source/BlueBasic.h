@@ -36,6 +36,16 @@ extern void BlueBasic_Init( uint8 task_id );
  */
 extern uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events );
 
+/*
+ * Task Initialization for the background flash compaction
+ */
+extern void BlueBasic_FlashstoreInit( uint8 task_id );
+
+/*
+ * Task Event Processor for the background flash compaction
+ */
+extern uint16 BlueBasic_FlashstoreProcessEvent( uint8 task_id, uint16 events );
+
 /*********************************************************************
 *********************************************************************/
 
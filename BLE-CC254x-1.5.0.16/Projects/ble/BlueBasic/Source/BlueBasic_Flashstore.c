@@ -41,7 +41,6 @@ static unsigned short** lineindexstart;
 static unsigned short** lineindexend;
 
 #define FLASHSTORE_PAGEBASE(IDX)  &flashstore[FLASHSTORE_PAGESIZE * (IDX)]
-#define FLASHSTORE_PADDEDSIZE(SZ) (((SZ) + 3) & -4)
 
 #if 0
 #define KEEP_ALIVE() osal_run_system()
@@ -49,7 +48,7 @@ static unsigned short** lineindexend;
 #define KEEP_ALIVE()
 #endif
 
-#if __APPLE__
+#if OS_HOST
 #define CHECK_VDD()
 #else
 #define CHECK_VDD() if (OS_get_vdd_7() <= 100) { SystemReset(); }
@@ -57,9 +56,13 @@ static unsigned short** lineindexend;
 
 //
 // Flash page structure:
-//  <age:4><data:FLASHSTORE_PAGESIZE-4>
+//  <age:4><erases:2><format:1><moveto:1><data:FLASHSTORE_PAGESIZE-8>
 //  Each page is given an age, starting at 1, as they are used. An age of 0xFFFFFFFF means the page is empty.
 //  The ages are used to reconstruct the program data by keeping the pages use ordered correctly.
+//  Erases counts how often the page has been erased, for wear leveling. Pages from before the
+//  erase count have their data straight after the age, where the format byte is the len of
+//  their first item (never 0) or 0xFF when empty. They get the new header when next erased.
+//  Moveto is FLASHPAGE_NOMOVE, or the page a compaction is moving the items to.
 //
 #ifdef TARGET_CC254X
 typedef unsigned long flashpage_age;
@@ -68,6 +71,20 @@ typedef unsigned int flashpage_age;
 #endif
 static flashpage_age lastage = 1;
 
+typedef struct
+{
+  flashpage_age age;
+  unsigned short erases;
+  unsigned char format;
+  unsigned char moveto;
+} flashpage_header;
+
+#define FLASHPAGE_FORMAT_ERASES   0
+#define FLASHPAGE_NOMOVE          0xFF
+#define FLASHPAGE_HASERASES(PAGE) (((flashpage_header*)(PAGE))->format == FLASHPAGE_FORMAT_ERASES)
+#define FLASHPAGE_DATA(PAGE)      ((unsigned char*)(PAGE) + (FLASHPAGE_HASERASES(PAGE) ? sizeof(flashpage_header) : sizeof(flashpage_age)))
+#define FLASHPAGE_ERASES(PAGE)    (FLASHPAGE_HASERASES(PAGE) ? ((flashpage_header*)(PAGE))->erases : 0)
+
 #define VAR_TYPE    int32_t
 extern void printmsg(const char *msg);
 extern void printnum(signed char fieldsize, VAR_TYPE num);
@@ -80,6 +97,100 @@ extern void printnum(signed char fieldsize, VAR_TYPE num);
 //
 
 static void flashstore_invalidate(unsigned short* mem);
+#if FLASHSTORE_COMPACT_STEP
+static unsigned char flashstore_recover(void);
+static unsigned char flashstore_findreserve(void);
+static void flashstore_move(unsigned char count, unsigned char* ram, unsigned char* ramend);
+#endif
+
+//
+// Line index checkpoint.
+//  The sorted line index is saved as special items FLASHSPECIAL_INDEX+n, each holding
+//  <stamp:4><count:2><offset:2>... where stamp is lastage when it was saved, count is the
+//  total number of lines, and the offsets are the flash word addresses of the lines in order.
+//  No page is erased without lastage changing, so at start up the checkpoint still holds
+//  if the stamp and count match and every entry is a valid line in ascending order.
+//
+#define FLASHINDEX_STAMP    FLASHSPECIAL_DATA_OFFSET
+#define FLASHINDEX_COUNT    (FLASHINDEX_STAMP + sizeof(flashpage_age))
+#define FLASHINDEX_ENTRY    (FLASHINDEX_COUNT + sizeof(unsigned short))
+#define FLASHINDEX_ITEMLEN  252
+#define FLASHINDEX_ENTRIES  ((FLASHINDEX_ITEMLEN - FLASHINDEX_ENTRY) / sizeof(unsigned short))
+static unsigned char indexsaved;
+
+//
+// Line lookup cache.
+//  A small direct mapped cache from line number to line index slot, so GOTO, GOSUB and
+//  event handlers don't binary search the index every time. Any change to the line index
+//  flushes it.
+//
+#if FLASHSTORE_LINECACHE_SIZE
+static struct
+{
+  unsigned short id;
+  unsigned short** line;
+} linecache[FLASHSTORE_LINECACHE_SIZE];
+unsigned long flashstore_linecache_hits;
+unsigned long flashstore_linecache_misses;
+#define LINECACHE_SLOT(ID)    (((ID) ^ ((ID) >> 4)) & (FLASHSTORE_LINECACHE_SIZE - 1))
+#define LINECACHE_FLUSH()     OS_memset(linecache, 0, sizeof(linecache))
+#else
+#define LINECACHE_FLUSH()
+#endif
+
+//
+// Special item directory.
+//  Where the specials with ids specialdirbase to specialdirbase+FLASHSTORE_SPECIALDIR_SIZE-1
+//  are in flash, or NULL if there is no such item. A miss moves the window to start at the
+//  missing id and fills it in one walk over the pages. Files are read and written record
+//  by record, so that walk also serves the following records. Compacting moves the items
+//  and flushes it.
+//
+#if FLASHSTORE_SPECIALDIR_SIZE
+static unsigned long specialdirbase;
+static unsigned short* specialdir[FLASHSTORE_SPECIALDIR_SIZE];
+unsigned long flashstore_specialdir_hits;
+unsigned long flashstore_specialdir_misses;
+#define SPECIALDIR_HAS(ID)    (specialdirbase && (unsigned long)(ID) - specialdirbase < FLASHSTORE_SPECIALDIR_SIZE)
+#define SPECIALDIR_SLOT(ID)   specialdir[(unsigned long)(ID) - specialdirbase]
+#define SPECIALDIR_FLUSH()    specialdirbase = 0
+
+static void specialdir_add(unsigned long id, unsigned short* mem)
+{
+  // keep the first item found, like the page walk does
+  if (SPECIALDIR_HAS(id) && !SPECIALDIR_SLOT(id))
+  {
+    SPECIALDIR_SLOT(id) = mem;
+  }
+}
+#else
+#define SPECIALDIR_FLUSH()
+#endif
+
+//
+// Background compaction.
+//  An idle task compacts pages a few items at a time, so writes rarely have to wait for
+//  flashstore_compact. One erased page is kept back from writes as the reserve. Once a
+//  page has FLASHSTORE_COMPACT_WASTE invalidated bytes its valid items are copied into
+//  the reserve and invalidated, then the emptied page is erased to be the next reserve.
+//  The line index, special directory and page specials follow each item as it moves.
+//  flashstore_compact moves pages into the reserve the same way, all at once. Nothing is
+//  erased before its items are safe on the reserve, and the page's moveto names the
+//  reserve meanwhile, so flashstore_init can finish a move cut short by a power failure.
+//
+#define FLASHSTORE_NOPAGE 0xFF
+#if FLASHSTORE_COMPACT_STEP
+static unsigned char reserve = FLASHSTORE_NOPAGE;
+static unsigned char victim = FLASHSTORE_NOPAGE;
+static unsigned short victimpos; // offset of the next item to copy
+static unsigned char recovering; // items may already be on the reserve
+
+// Stop copying, which leaves both pages intact but no longer an empty reserve
+#define COMPACT_ABANDON() \
+  do { if (victim != FLASHSTORE_NOPAGE) { victim = FLASHSTORE_NOPAGE; reserve = FLASHSTORE_NOPAGE; } } while (0)
+#else
+#define COMPACT_ABANDON()
+#endif
 
 //
 // Heapsort
@@ -140,17 +251,11 @@ static void flashpage_heapsort(void)
 
 
 //
-// Initialize the flashstore.
-//  Rebuild the program store from the flash store.
-//  Called when the interpreter powers up.
+// Walk every page, collecting the page usage and the (unsorted) program lines.
 //
-unsigned char** flashstore_init(unsigned char** startmem)
+static void flashstore_scan(void)
 {
-  lineindexstart = (unsigned short**)startmem;
   lineindexend = lineindexstart;
-
-  OS_flashstore_init();
-
   unsigned char ordered = 0;
   const unsigned char* page;
   unsigned char pnr = FLASHSTORE_NRPAGES;
@@ -158,7 +263,7 @@ unsigned char** flashstore_init(unsigned char** startmem)
   {
     orderedpages[ordered].waste = 0;
     orderedpages[ordered].special = (unsigned short*)0;
-    if (*(flashpage_age*)page > lastage)
+    if (*(flashpage_age*)page > lastage && *(flashpage_age*)page != 0xFFFFFFFF)
     {
       lastage = *(flashpage_age*)page;
     }
@@ -166,7 +271,7 @@ unsigned char** flashstore_init(unsigned char** startmem)
     // Analyse page
     const unsigned char* ptr;
     // the loop need to be kept inside a page, even at the end of the memory bank
-    for (ptr = page + sizeof(flashpage_age); (ptr <= page + (FLASHSTORE_PAGESIZE-1)) && (ptr > page) ; )
+    for (ptr = FLASHPAGE_DATA(page); (ptr <= page + (FLASHSTORE_PAGESIZE-1)) && (ptr > page) ; )
     {
       unsigned short id = *(unsigned short*)ptr;
       if (id == FLASHID_FREE)
@@ -201,18 +306,148 @@ unsigned char** flashstore_init(unsigned char** startmem)
     orderedpages[ordered].free = FLASHSTORE_PAGESIZE - (ptr - page);
     ordered++;
   }
+}
+
+//
+// Replace the collected lines with the sorted ones from the checkpoint.
+//  Returns 1 when loaded, 0 if the checkpoint is stale and -1 if that was only
+//  found after the index was partly overwritten.
+//
+static signed char flashstore_loadindex(void)
+{
+  const unsigned short count = lineindexend - lineindexstart;
+  unsigned short** line = lineindexstart;
+  unsigned short last = 0;
+  unsigned long chunk = FLASHSPECIAL_INDEX;
+
+  while (line < lineindexend)
+  {
+    const unsigned char* item = flashstore_findspecial(chunk++);
+    if (!item || *(flashpage_age*)(item + FLASHINDEX_STAMP) != lastage || *(unsigned short*)(item + FLASHINDEX_COUNT) != count)
+    {
+      return line == lineindexstart ? 0 : -1;
+    }
+    const unsigned short* entry = (unsigned short*)(item + FLASHINDEX_ENTRY);
+    const unsigned short* end = (unsigned short*)(item + item[FLASHSPECIAL_DATA_LEN]);
+    for (; entry < end && line < lineindexend; entry++)
+    {
+      // Must be an item inside the store (not a page header)
+      if (*entry >= FLASHSTORE_WORDS(FLASHSTORE_LEN))
+      {
+        return -1;
+      }
+      unsigned short* ptr = (unsigned short*)(flashstore + ((unsigned long)*entry << 2));
+      if ((unsigned char*)ptr < FLASHPAGE_DATA(FLASHSTORE_PAGEBASE(*entry / FLASHSTORE_WORDS(FLASHSTORE_PAGESIZE)))
+          || *ptr <= last || *ptr >= FLASHID_SPECIAL)
+      {
+        return -1;
+      }
+      last = *ptr;
+      *line++ = ptr;
+    }
+  }
+  return 1;
+}
+
+//
+// Initialize the flashstore.
+//  Rebuild the program store from the flash store.
+//  Called when the interpreter powers up.
+//
+unsigned char** flashstore_init(unsigned char** startmem)
+{
+  lineindexstart = (unsigned short**)startmem;
+  LINECACHE_FLUSH();
+  SPECIALDIR_FLUSH();
+  COMPACT_ABANDON();
 
-  // We now have a set of program lines, indexed from "startmem" to "mem" which we need to sort
-  flashpage_heapsort();
+  OS_flashstore_init();
+
+  flashstore_scan();
+#if FLASHSTORE_COMPACT_STEP
+  if (flashstore_recover())
+  {
+    // The moves looked lines up in the unsorted index, caching where they were
+    LINECACHE_FLUSH();
+    flashstore_scan();
+  }
+#endif
+  signed char loaded = flashstore_loadindex();
+  if (loaded < 0)
+  {
+    flashstore_scan();
+  }
+  if (loaded <= 0)
+  {
+    // We now have a set of program lines, indexed from "startmem" to "mem" which we need to sort
+    flashpage_heapsort();
+  }
+  indexsaved = loaded > 0;
   
   return (unsigned char**)lineindexend;
 }
 
+//
+// Save the line index as a checkpoint, unless it already is.
+//  The items are built in free memory above the heap. Gives up, to try again
+//  next time, when there is no room there or in the flash.
+//
+void flashstore_checkpoint(void)
+{
+  if (indexsaved || heap + FLASHINDEX_ITEMLEN > sp)
+  {
+    return;
+  }
+  for (unsigned long chunk = FLASHSPECIAL_INDEX; flashstore_deletespecial(chunk); chunk++)
+    ;
+
+  // Write the first item last so the checkpoint is never complete by accident
+  const unsigned short count = lineindexend - lineindexstart;
+  unsigned short first = count - count % FLASHINDEX_ENTRIES;
+  if (first == count && first)
+  {
+    first -= FLASHINDEX_ENTRIES;
+  }
+  for (; count; first -= FLASHINDEX_ENTRIES)
+  {
+    unsigned char* item = heap;
+    unsigned short* entry = (unsigned short*)(item + FLASHINDEX_ENTRY);
+    unsigned short n = count - first > FLASHINDEX_ENTRIES ? FLASHINDEX_ENTRIES : count - first;
+
+    *(unsigned long*)(item + FLASHSPECIAL_ITEM_ID) = FLASHSPECIAL_INDEX + first / FLASHINDEX_ENTRIES;
+    item[FLASHSPECIAL_DATA_LEN] = FLASHINDEX_ENTRY + n * sizeof(unsigned short);
+    *(flashpage_age*)(item + FLASHINDEX_STAMP) = lastage;
+    *(unsigned short*)(item + FLASHINDEX_COUNT) = count;
+    for (unsigned short** line = lineindexstart + first; n--; line++)
+    {
+      *entry++ = ((unsigned char*)*line - flashstore) >> 2;
+    }
+    if (!flashstore_addspecial(item))
+    {
+      return;
+    }
+    if (!first)
+    {
+      break;
+    }
+  }
+  indexsaved = 1;
+}
+
 //
 // Find the closest, lower or equal, ID
 //
 unsigned short** flashstore_findclosest(unsigned short id)
 {
+#if FLASHSTORE_LINECACHE_SIZE
+  unsigned char slot = LINECACHE_SLOT(id);
+  if (linecache[slot].line && linecache[slot].id == id)
+  {
+    flashstore_linecache_hits++;
+    return linecache[slot].line;
+  }
+  flashstore_linecache_misses++;
+#endif
   unsigned short** lines = lineindexstart;
   unsigned short min = 0;
   unsigned short max = lineindexend - lines;
@@ -232,6 +467,10 @@ unsigned short** flashstore_findclosest(unsigned short id)
       }
     }
   }
+#if FLASHSTORE_LINECACHE_SIZE
+  linecache[slot].id = id;
+  linecache[slot].line = lines + min;
+#endif
   return lines + min;
 }
 
@@ -246,6 +485,12 @@ static signed char flashstore_findspace(unsigned char len)
   for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
   {
     flashpage_age cage = *(flashpage_age*)FLASHSTORE_PAGEBASE(pg);
+#if FLASHSTORE_COMPACT_STEP
+    if (pg == reserve || pg == victim)
+    {
+      continue;
+    }
+#endif
     if (cage < age && orderedpages[pg].free >= len)
     {
       spg = pg;
@@ -263,6 +508,8 @@ unsigned char** flashstore_addline(unsigned char* line)
   unsigned short id = *(unsigned short*)line;
   unsigned short** oldlineptr = flashstore_findclosest(id);
   unsigned char found = 0;
+  LINECACHE_FLUSH();
+  indexsaved = 0;
   if (oldlineptr < lineindexend && **oldlineptr == id)
   {
     found = 1;
@@ -319,13 +566,22 @@ unsigned char** flashstore_addline(unsigned char* line)
 unsigned char flashstore_addspecial(unsigned char* item)
 {
   *(unsigned short*)item = FLASHID_SPECIAL;
-  unsigned char len = FLASHSTORE_PADDEDSIZE(item[sizeof(unsigned short)]);
+  return flashstore_addspecials(item, FLASHSTORE_PADDEDSIZE(item[sizeof(unsigned short)])) != NULL;
+}
+
+//
+// Add special items, packed back to back at their padded sizes, with a single
+// flash write into the youngest page they fit in together. Returns where they
+// went, or NULL.
+//
+unsigned char* flashstore_addspecials(unsigned char* items, unsigned char len)
+{
   // Find space for the new line in the youngest page
   signed char pg = flashstore_findspace(len);
   if (pg != -1)
   {
     unsigned short* mem = (unsigned short*)(FLASHSTORE_PAGEBASE(pg) + FLASHSTORE_PAGESIZE - orderedpages[pg].free);
-    OS_flashstore_write(FLASHSTORE_FADDR(mem), item, FLASHSTORE_WORDS(len));
+    OS_flashstore_write(FLASHSTORE_FADDR(mem), items, FLASHSTORE_WORDS(len));
     orderedpages[pg].free -= len;
     if ( ((orderedpages[pg].special != 0) && (mem < orderedpages[pg].special)) || orderedpages[pg].special == 0 )
     {
@@ -333,17 +589,45 @@ unsigned char flashstore_addspecial(unsigned char* item)
       // or its the first entry in this page
       orderedpages[pg].special = mem;
     }
-    return 1;
+#if FLASHSTORE_SPECIALDIR_SIZE
+    for (unsigned char pos = 0; pos < len; pos += FLASHSTORE_PADDEDSIZE(items[pos + sizeof(unsigned short)]))
+    {
+      specialdir_add(*(unsigned long*)(items + pos + FLASHSPECIAL_ITEM_ID), (unsigned short*)((unsigned char*)mem + pos));
+    }
+#endif
+    return (unsigned char*)mem;
   }
   else
   {
-    return 0;
+    return NULL;
   }
 }
 
+//
+// The age of the youngest page. No page is erased without it changing, so until
+// then an item stays where it was written or is invalidated there.
+//
+unsigned long flashstore_stamp(void)
+{
+  return lastage;
+}
+
 unsigned char flashstore_deletespecial(unsigned long specialid)
 {
-  unsigned char* ptr = flashstore_findspecial(specialid);
+  return flashstore_deletespecialat(specialid, NULL, 0);
+}
+
+//
+// Delete a special item, looking where it was written at flashstore_stamp() stamp
+// first so that it needn't be looked up.
+//
+unsigned char flashstore_deletespecialat(unsigned long specialid, unsigned char* ptr, unsigned long stamp)
+{
+  if (!ptr || stamp != lastage || *(unsigned short*)ptr != FLASHID_SPECIAL ||
+      *(unsigned long*)(ptr + FLASHSPECIAL_ITEM_ID) != specialid)
+  {
+    ptr = flashstore_findspecial(specialid);
+  }
   if (ptr)
   {
     flashstore_invalidate((unsigned short*)ptr);
@@ -358,6 +642,16 @@ unsigned char flashstore_deletespecial(unsigned long specialid)
 
 unsigned char* flashstore_findspecial(unsigned long specialid)
 {
+#if FLASHSTORE_SPECIALDIR_SIZE
+  if (SPECIALDIR_HAS(specialid))
+  {
+    flashstore_specialdir_hits++;
+    return (unsigned char*)SPECIALDIR_SLOT(specialid);
+  }
+  flashstore_specialdir_misses++;
+  OS_memset(specialdir, 0, sizeof(specialdir));
+  specialdirbase = specialid;
+#endif
   const unsigned char* page;
   unsigned char pnr = 0;
   for (page = flashstore; pnr < FLASHSTORE_NRPAGES; page += FLASHSTORE_PAGESIZE, pnr++)
@@ -374,7 +668,7 @@ unsigned char* flashstore_findspecial(unsigned long specialid)
     }
     else
     {
-      ptr = page + sizeof(flashpage_age);
+      ptr = FLASHPAGE_DATA(page);
     }
     for ( ;
          (ptr <= page + (FLASHSTORE_PAGESIZE-1)) && (ptr > page);
@@ -392,14 +686,23 @@ unsigned char* flashstore_findspecial(unsigned long specialid)
       else if (id == FLASHID_SPECIAL) {
         if (orderedpages[pnr].special == (unsigned short*)1)
           orderedpages[pnr].special = (unsigned short*)ptr;
+#if FLASHSTORE_SPECIALDIR_SIZE
+        // keep walking to fill in the rest of the window
+        specialdir_add(*(unsigned long*)(ptr + FLASHSPECIAL_ITEM_ID), (unsigned short*)ptr);
+#else
         if (*(unsigned long*)(ptr + FLASHSPECIAL_ITEM_ID) == specialid)
         {
           return (unsigned char*)ptr;
         }
+#endif
       }
     }
   }
+#if FLASHSTORE_SPECIALDIR_SIZE
+  return (unsigned char*)SPECIALDIR_SLOT(specialid);
+#else
   return NULL;
+#endif
 }
 
 //
@@ -408,6 +711,8 @@ unsigned char* flashstore_findspecial(unsigned long specialid)
 unsigned char** flashstore_deleteline(unsigned short id)
 {
   unsigned short** oldlineptr = flashstore_findclosest(id);
+  LINECACHE_FLUSH();
+  indexsaved = 0;
   if (lineindexstart != lineindexend) {
     if (*oldlineptr != NULL && **oldlineptr == id)
     {
@@ -424,6 +729,25 @@ unsigned char** flashstore_deleteline(unsigned short id)
   return (unsigned char**)lineindexend;
 }
 
+//
+// Erase a page and give it a new header, counting the erase.
+//
+static void flashpage_erase(unsigned char pg)
+{
+  static flashpage_header header;
+  const unsigned char* base = FLASHSTORE_PAGEBASE(pg);
+  header.erases = FLASHPAGE_ERASES(base) + 1;
+  header.format = FLASHPAGE_FORMAT_ERASES;
+  header.moveto = FLASHPAGE_NOMOVE;
+  CHECK_VDD();
+  OS_flashstore_erase(FLASHSTORE_FPAGE(base));
+  header.age = ++lastage;
+  OS_flashstore_write(FLASHSTORE_FADDR(base), (unsigned char*)&header, FLASHSTORE_WORDS(sizeof(header)));
+  orderedpages[pg].waste = 0;
+  orderedpages[pg].free = FLASHSTORE_PAGESIZE - sizeof(flashpage_header);
+  orderedpages[pg].special = 0;
+}
+
 //
 // Delete everything from the store.
 //
@@ -432,22 +756,20 @@ unsigned char** flashstore_deleteall(void)
   static unsigned char pg;
   for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
   {
-    if (orderedpages[pg].free != FLASHSTORE_PAGESIZE - sizeof(flashpage_age))
+    const unsigned char* base = FLASHSTORE_PAGEBASE(pg);
+    if (orderedpages[pg].free != FLASHSTORE_PAGESIZE - (FLASHPAGE_DATA(base) - base))
     {
-      const unsigned char* base = FLASHSTORE_PAGEBASE(pg);
-      CHECK_VDD();
-      OS_flashstore_erase(FLASHSTORE_FPAGE(base));
-      lastage++;
-      OS_flashstore_write(FLASHSTORE_FADDR(base), (unsigned char*)&lastage, FLASHSTORE_WORDS(sizeof(lastage)));
-      orderedpages[pg].waste = 0;
-      orderedpages[pg].free = FLASHSTORE_PAGESIZE - sizeof(flashpage_age);
-      orderedpages[pg].special = 0;
+      flashpage_erase(pg);
     }
     // keep OSAL spinning
     KEEP_ALIVE();
   }
 
   lineindexend = lineindexstart;
+  LINECACHE_FLUSH();
+  SPECIALDIR_FLUSH();
+  COMPACT_ABANDON();
+  indexsaved = 0;
   return (unsigned char**)lineindexend;
 }
 
@@ -469,142 +791,1091 @@ unsigned int flashstore_freemem(void)
   return free;
 }
 
-void flashstore_compact(unsigned char len, unsigned char* tempmemstart, unsigned char* tempmemend)
+//
+// Packed records.
+//  A block of packed file records holds <len:1><value>... for each record. The values are
+//  the words of the record (what an integer variable writes) then the bytes left at its end,
+//  each the zigzag varint of its difference to the same place in the record before, or to 0
+//  past the end of that one. Slowly changing values take a byte or two.
+//
+#define FLASHSTORE_PACKSIZE(LEN, POS) ((LEN) - (POS) >= sizeof(VAR_TYPE) ? sizeof(VAR_TYPE) : 1)
+
+static unsigned long flashstore_packvalue(const unsigned char* rec, unsigned char len, unsigned char pos, unsigned char size)
 {
-  unsigned short available =
-    ( (tempmemend - tempmemstart)  // free heap
-     + ((unsigned char*)lineindexend - (unsigned char*)lineindexstart) ); // optional index
-  //  & (unsigned short)(FLASHSTORE_PAGESIZE - 1);  // limit to page size
-  // Find the lowest age page which this will fit in.
-  static unsigned char pg;
-  static unsigned char selected;
-  static unsigned short occupied;
-  static flashpage_age age;
-  age = 0xFFFFFFFF;
-  selected = 0;
-  len = FLASHSTORE_PADDEDSIZE(len);
-  if (available > FLASHSTORE_PAGESIZE)
+  unsigned long value = 0;
+  while (size--)
   {
-    available = FLASHSTORE_PAGESIZE;
+    value = (value << 8) | (pos + size < len ? rec[pos + size] : 0);
   }
-  for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+  return value;
+}
+
+//
+// Pack rec after prev into out, and return where the next record goes.
+//
+unsigned char* flashstore_pack(unsigned char* out, const unsigned char* prev, unsigned char prevlen, const unsigned char* rec, unsigned char len)
+{
+  *out++ = len;
+  for (unsigned char pos = 0; pos < len; )
   {
-    flashpage_age cage = *(flashpage_age*)FLASHSTORE_PAGEBASE(pg);
-    unsigned short cfree = orderedpages[pg].free + orderedpages[pg].waste;
-    if ((cage < age && cfree >= len)
-        && cfree <= available)
+    unsigned char size = FLASHSTORE_PACKSIZE(len, pos);
+    unsigned char top = size * 8 - 1;
+    unsigned long delta = flashstore_packvalue(rec, len, pos, size) - flashstore_packvalue(prev, prevlen, pos, size);
+    // Zigzag, so small differences either way leave the high bits clear
+    delta = ((delta << 1) ^ (0 - ((delta >> top) & 1))) & (0xFFFFFFFF >> (31 - top));
+    do
     {
-      selected = pg;
-      age = cage;
-      occupied = FLASHSTORE_PAGESIZE - cfree;
-    }
+      *out = delta & 0x7F;
+      delta >>= 7;
+      if (delta)
+      {
+        *out |= 0x80;
+      }
+      out++;
+    } while (delta);
+    pos += size;
   }
-    
-  // Need at least FLASHSTORE_PAGESIZE
-  if ( (occupied > available) || (age == 0xFFFFFFFF) )
-    return;
-    
-  // close access to the flash store
-  static halIntState_t intState;
-  HAL_ENTER_CRITICAL_SECTION(intState);
-  
-  unsigned short heap_len = 0;
-  char corrupted = 0;
+  return out;
+}
 
-  if (occupied > tempmemend - tempmemstart)  
+//
+// Unpack the record at in over the one before it in rec, which was len bytes long
+// and is len bytes long after. Returns where the next record starts.
+//
+const unsigned char* flashstore_unpack(const unsigned char* in, unsigned char* rec, unsigned char* len)
+{
+  unsigned char prevlen = *len;
+  unsigned char size;
+
+  *len = *in++;
+  if (*len > prevlen)
   {
-    // use additionally index area for compacting
-    // by moving heap to to beginning
-    // Attention: this assumes that tempmemstart is the current heap end!
-    heap_len = tempmemstart - (unsigned char*)lineindexend;
-    tempmemstart = OS_memcpy((void*)lineindexstart, (void*)lineindexend, heap_len);
-    corrupted = 1; // since we use the index area it is definitly corrupted
+    OS_memset(rec + prevlen, 0, *len - prevlen);
   }
-  
-  // Found enough space for the line, compact the page
-  // Copy required page data into RAM
-  unsigned char* ram = tempmemstart + sizeof(flashpage_age);
-  unsigned char* flash = (unsigned char*)FLASHSTORE_PAGEBASE(selected);
-  static unsigned char* ptr;
-  unsigned short mem_length = sizeof(flashpage_age);
-  char deleted = 0;
-  unsigned short *special = 0;
-  for (ptr = flash + sizeof(flashpage_age); (ptr <= flash + (FLASHSTORE_PAGESIZE-1)) && (ptr > flash); )
+  for (unsigned char pos = 0; pos < *len; pos += size)
   {
-    unsigned short id = *(unsigned short*)ptr;
-    unsigned char itemlen = FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]);
-    if (id == FLASHID_FREE)
-    {
-      // the rest of the page is empty
-      break;
-    }
-    else if (id != FLASHID_INVALID)
+    unsigned long delta = 0;
+    unsigned char shift = 0;
+    size = FLASHSTORE_PACKSIZE(*len, pos);
+    do
     {
-      corrupted |= (id != FLASHID_SPECIAL) && deleted;
-      if (special == 0 && id == FLASHID_SPECIAL)
-      {
-        special = (unsigned short *)(flash + mem_length);
-      }
-      if (mem_length + itemlen <= available)
-      {
-        ram = OS_memcpy(ram, ptr, itemlen);
-        mem_length += itemlen;
-      }
-      else 
-      {
-        corrupted = 1;
-        goto exit;   
-      } 
-    }
-    else
+      delta |= (unsigned long)(*in & 0x7F) << shift;
+      shift += 7;
+    } while ((*in++ & 0x80) && shift < 35);
+    delta = ((delta >> 1) ^ (0 - (delta & 1))) + flashstore_packvalue(rec, *len, pos, size);
+    for (unsigned char i = 0; i < size; i++, delta >>= 8)
     {
-      deleted = 1;
+      rec[pos + i] = (unsigned char)delta;
     }
-    ptr += itemlen;
   }
-  CHECK_VDD();
-  // Erase the page
-  OS_flashstore_erase(FLASHSTORE_FPAGE(flash));
-  *(flashpage_age*)tempmemstart = ++lastage; 
-//  OS_flashstore_write(FLASHSTORE_FADDR(flash), (unsigned char*)&lastage, FLASHSTORE_WORDS(sizeof(lastage)));
-  orderedpages[selected].waste = 0;
-  orderedpages[selected].free = FLASHSTORE_PAGESIZE - mem_length; // - sizeof(flashpage_age);
-  orderedpages[selected].special = special;
+  return in;
+}
 
-  // Copy the old lines back in.
-  //flash += sizeof(flashpage_age);
-  OS_flashstore_write(FLASHSTORE_FADDR(flash), tempmemstart, FLASHSTORE_WORDS(mem_length));
-  if (corrupted)
+//
+// How many records a block holds.
+//
+unsigned char flashstore_packcount(const unsigned char* block)
+{
+  unsigned char count = 0;
+  for (const unsigned char* in = block + FLASHSPECIAL_DATA_OFFSET; in < block + block[FLASHSPECIAL_DATA_LEN]; count++)
   {
-    if (heap_len)
+    unsigned char len = *in++;
+    for (unsigned char values = len / sizeof(VAR_TYPE) + len % sizeof(VAR_TYPE); values; values--)
     {
-      // copy old heap data back into position before rebuilding the index
-      OS_memcpy((void*)lineindexend, (void*)lineindexstart, heap_len);
+      while (*in++ & 0x80)
+        ;
     }
-    // We corrupted memory, so we need to reinitialize
-    flashstore_init((unsigned char**)lineindexstart);
   }
-exit:
-  HAL_EXIT_CRITICAL_SECTION(intState); 
+  return count;
 }
 
+static unsigned short fsck_errors;
+
 //
-// Invalidate the line entry at the given address.
+// Report an inconsistency, at an offset in a page unless pg is FLASHSTORE_NOPAGE.
 //
-static void flashstore_invalidate(unsigned short* mem)
+static void flashstore_fsckerror(unsigned char pg, unsigned short offset, const char* msg)
 {
-  static struct
+  if (pg != FLASHSTORE_NOPAGE)
   {
-    unsigned short invalid;
-    unsigned char len;
-    unsigned char padding;
-  } invalid;
+    printnum(0, pg);
+    OS_putchar(':');
+    printnum(0, offset);
+    OS_putchar(' ');
+  }
+  printmsg(msg);
+  fsck_errors++;
+}
+
+//
+// Check the flashstore and report how its pages are used, to size FLASHSTORE_NRPAGES
+// and diagnose devices. It only reads the flash, so it works on an image which was
+// never passed through flashstore_init too. The memory from ram to ramend holds a
+// bitmap of the line numbers to find repeated lines. An age of 0 is an erased page.
+// Returns the number of errors.
+//
+unsigned short flashstore_fsck(unsigned char* ram, unsigned char* ramend)
+{
+  enum { FSCK_LINES, FSCK_AUTORUN, FSCK_SNV, FSCK_INDEX, FSCK_META, FSCK_OTHER, FSCK_TYPES };
+  unsigned short counts[FSCK_TYPES];
+  unsigned long files = 0;
+  unsigned long live = 0;
+  unsigned long invalid = 0;
+  unsigned long free = 0;
+  unsigned short mostinvalid = 0;
+  unsigned short maxline = 0;
+  unsigned char pg;
+  unsigned char type;
+  const unsigned char* ptr;
+
+  fsck_errors = 0;
+  OS_memset(counts, 0, sizeof(counts));
+  printmsg("PAGE       AGE ERASES  LIVE INVALID  FREE ITEMS");
+  for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+  {
+    const unsigned char* page = FLASHSTORE_PAGEBASE(pg);
+    flashpage_age age = *(flashpage_age*)page;
+    unsigned short pglive = 0;
+    unsigned short pginvalid = 0;
+    unsigned short items = 0;
+
+    ptr = page;
+    if (age != 0xFFFFFFFF)
+    {
+      for (unsigned char other = 0; other < pg; other++)
+      {
+        if (*(flashpage_age*)FLASHSTORE_PAGEBASE(other) == age)
+        {
+          flashstore_fsckerror(pg, 0, "age repeated");
+        }
+      }
+#if FLASHSTORE_COMPACT_STEP
+      if (FLASHPAGE_HASERASES(page) && ((flashpage_header*)page)->moveto != FLASHPAGE_NOMOVE && pg != victim)
+#else
+      if (FLASHPAGE_HASERASES(page) && ((flashpage_header*)page)->moveto != FLASHPAGE_NOMOVE)
+#endif
+      {
+        flashstore_fsckerror(pg, 0, "move unfinished");
+      }
+      for (ptr = FLASHPAGE_DATA(page); ptr < page + FLASHSTORE_PAGESIZE && *(unsigned short*)ptr != FLASHID_FREE; ptr += FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]))
+      {
+        unsigned short id = *(unsigned short*)ptr;
+        unsigned char len = FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]);
+        if (ptr[sizeof(unsigned short)] <= sizeof(unsigned short) || ptr + len > page + FLASHSTORE_PAGESIZE)
+        {
+          flashstore_fsckerror(pg, ptr - page, "bad item length");
+          ptr = page + FLASHSTORE_PAGESIZE;
+          break;
+        }
+        if (id == FLASHID_INVALID)
+        {
+          pginvalid += len;
+          continue;
+        }
+        pglive += len;
+        items++;
+        if (id != FLASHID_SPECIAL)
+        {
+          maxline = id > maxline ? id : maxline;
+          counts[FSCK_LINES]++;
+          continue;
+        }
+        // Special ids are 32 bits, wherever a long is wider
+        unsigned long specialid = *(unsigned long*)(ptr + FLASHSPECIAL_ITEM_ID) & 0xFFFFFFFF;
+        if (specialid >= FLASHSPECIAL_FILE0 && specialid < FLASHSPECIAL_FILE25 + 0x10000)
+        {
+          files |= 1UL << ((specialid - FLASHSPECIAL_FILE0) >> 16);
+          continue;
+        }
+        if (specialid >= FLASHSPECIAL_BLOCK0 && specialid < FLASHSPECIAL_BLOCK25 + 0x10000)
+        {
+          files |= 1UL << ((specialid - FLASHSPECIAL_BLOCK0) >> 16);
+          continue;
+        }
+        if (FS_IS_CHAIN_SPECIAL(specialid))
+        {
+          files |= 1UL << (((specialid & 0x00FFFFFF) - FLASHSPECIAL_CHAIN0) >> 16);
+          continue;
+        }
+        if (specialid >= FLASHSPECIAL_TIME0 && specialid < FLASHSPECIAL_TIME25 + 0x10000)
+        {
+          // A TIME file's index counts with the files' metadata
+          counts[FSCK_META]++;
+          continue;
+        }
+        switch (specialid & 0xFFFFFF00)
+        {
+          case 0:
+            type = specialid == FLASHSPECIAL_AUTORUN ? FSCK_AUTORUN : FSCK_OTHER;
+            break;
+          case FLASHSPECIAL_SNV:
+            type = FSCK_SNV;
+            break;
+          case FLASHSPECIAL_INDEX:
+            type = FSCK_INDEX;
+            break;
+          case FLASHSPECIAL_FILEMETA:
+            type = FSCK_META;
+            break;
+          default:
+            type = FSCK_OTHER;
+            break;
+        }
+        counts[type]++;
+      }
+    }
+    // Whatever follows the items must still be erased
+    unsigned short pgfree = page + FLASHSTORE_PAGESIZE - ptr;
+    for (; ptr < page + FLASHSTORE_PAGESIZE; ptr++)
+    {
+      if (*ptr != 0xFF)
+      {
+        flashstore_fsckerror(pg, ptr - page, "data in free space");
+        break;
+      }
+    }
+    printnum(4, pg);
+    printnum(10, age == 0xFFFFFFFF ? 0 : age);
+    printnum(7, FLASHPAGE_ERASES(page));
+    printnum(6, pglive);
+    printnum(8, pginvalid);
+    printnum(6, pgfree);
+    printnum(6, items);
+    OS_putchar('\n');
+    live += pglive;
+    invalid += pginvalid;
+    free += pgfree;
+    mostinvalid = pginvalid > mostinvalid ? pginvalid : mostinvalid;
+  }
+
+  printmsg("LINES AUTORUN   SNV INDEX  META OTHER");
+  printnum(5, counts[FSCK_LINES]);
+  printnum(8, counts[FSCK_AUTORUN]);
+  for (type = FSCK_SNV; type < FSCK_TYPES; type++)
+  {
+    printnum(6, counts[type]);
+  }
+  OS_putchar('\n');
+  if (files)
+  {
+    printmsg("FILE RECORDS BYTES");
+    for (unsigned char name = 0; name < 26; name++)
+    {
+      if (files & (1UL << name))
+      {
+        unsigned short records = 0;
+        unsigned short bytes = 0;
+        for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+        {
+          const unsigned char* page = FLASHSTORE_PAGEBASE(pg);
+          for (ptr = FLASHPAGE_DATA(page); *(flashpage_age*)page != 0xFFFFFFFF && ptr < page + FLASHSTORE_PAGESIZE && *(unsigned short*)ptr != FLASHID_FREE && ptr[sizeof(unsigned short)] > sizeof(unsigned short); ptr += FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]))
+          {
+            if (*(unsigned short*)ptr != FLASHID_SPECIAL)
+            {
+              continue;
+            }
+            unsigned long special = (*(unsigned long*)(ptr + FLASHSPECIAL_ITEM_ID) & 0xFFFFFFFF) >> 16;
+            if (special == (FLASHSPECIAL_FILE0 >> 16) + name)
+            {
+              records++;
+            }
+            else if (special == (FLASHSPECIAL_BLOCK0 >> 16) + name)
+            {
+              records += flashstore_packcount(ptr);
+            }
+            else if ((special & 0xFF) == (FLASHSPECIAL_CHAIN0 >> 16) + name)
+            {
+              // A chained record is counted by its first part
+              records += special == (FLASHSPECIAL_CHAIN0 >> 16) + name;
+            }
+            else
+            {
+              continue;
+            }
+            bytes += ptr[sizeof(unsigned short)] - FLASHSPECIAL_DATA_OFFSET;
+          }
+        }
+        OS_putchar(' ');
+        OS_putchar(' ');
+        OS_putchar(' ');
+        OS_putchar('A' + name);
+        printnum(8, records);
+        printnum(6, bytes);
+        OS_putchar('\n');
+      }
+    }
+  }
+
+  // Every line number must be live just once
+  if (ram + maxline / 8 + 1 > ramend)
+  {
+    printmsg("Too little memory to check lines.");
+  }
+  else
+  {
+    OS_memset(ram, 0, maxline / 8 + 1);
+    for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+    {
+      const unsigned char* page = FLASHSTORE_PAGEBASE(pg);
+      for (ptr = FLASHPAGE_DATA(page); *(flashpage_age*)page != 0xFFFFFFFF && ptr < page + FLASHSTORE_PAGESIZE && *(unsigned short*)ptr != FLASHID_FREE && ptr[sizeof(unsigned short)] > sizeof(unsigned short); ptr += FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]))
+      {
+        unsigned short id = *(unsigned short*)ptr;
+        if (id != FLASHID_INVALID && id != FLASHID_SPECIAL)
+        {
+          if (ram[id / 8] & (1 << (id % 8)))
+          {
+            flashstore_fsckerror(pg, ptr - page, "line repeated");
+          }
+          ram[id / 8] |= 1 << (id % 8);
+        }
+      }
+    }
+  }
+  if (lineindexstart && lineindexend - lineindexstart != counts[FSCK_LINES])
+  {
+    flashstore_fsckerror(FLASHSTORE_NOPAGE, 0, "Line index out of step.");
+  }
+
+  printnum(0, live);
+  printmsg(" bytes live.");
+  printnum(0, free);
+  printmsg(" bytes free.");
+  printnum(0, invalid);
+  printmsg(" bytes to free by compacting.");
+  printnum(0, mostinvalid);
+  printmsg(" bytes at most from one page.");
+  printnum(0, invalid + free ? invalid * 100 / (invalid + free) : 0);
+  printmsg("% of the space left fragmented.");
+  printnum(0, fsck_errors);
+  printmsg(" errors.");
+  return fsck_errors;
+}
+
+//
+// Relocation runs.
+//  When a page is rewritten its lines move in runs which keep their distance, from their
+//  old offset in the page to their new one. The runs are kept highest offset first, and
+//  let the line index be patched in place rather than rebuilt and sorted again.
+//
+typedef struct
+{
+  unsigned short from;
+  unsigned short to;
+} flashstore_reloc;
+
+//
+// Where a line on page went to on the page to, or NULL when it wasn't on page.
+//
+static unsigned short* flashstore_relocated(unsigned short* line, const unsigned char* page, const unsigned char* to, const flashstore_reloc* runs, unsigned char nruns)
+{
+  if ((unsigned char*)line < page || (unsigned char*)line >= page + FLASHSTORE_PAGESIZE)
+  {
+    return NULL;
+  }
+  unsigned short offset = (unsigned char*)line - page;
+  unsigned char lo = 0;
+  unsigned char hi = nruns;
+  while (lo < hi)
+  {
+    unsigned char mid = (lo + hi) / 2;
+    if (runs[mid].from <= offset)
+    {
+      hi = mid;
+    }
+    else
+    {
+      lo = mid + 1;
+    }
+  }
+  if (lo == nruns)
+  {
+    return NULL;
+  }
+  return (unsigned short*)(to + runs[lo].to + (offset - runs[lo].from));
+}
+
+#if FLASHSTORE_WEAR_SPREAD
+//
+// Swap the contents of a page which hardly ever gets erased, as it holds static data,
+// with those of the worn page just compacted. The worn page then rests while the other
+// takes its share of the erases. Both pages' items are gathered in RAM, and nothing
+// is done when they don't fit there.
+//
+static void flashstore_swap(unsigned char cold, unsigned char worn, unsigned char* ram, unsigned char* ramend)
+{
+  const unsigned char* coldpage = FLASHSTORE_PAGEBASE(cold);
+  const unsigned char* wornpage = FLASHSTORE_PAGEBASE(worn);
+  unsigned short wornlen = FLASHSTORE_PAGESIZE - orderedpages[worn].free;
+  flashpage_header* tocold = (flashpage_header*)ram;
+  flashpage_header* toworn = (flashpage_header*)(ram + wornlen);
+  unsigned short coldlen = sizeof(flashpage_header);
+  const unsigned char* ptr;
+  // The cold lines' runs go down from the end of the memory
+  flashstore_reloc* runs = (flashstore_reloc*)ramend;
+  unsigned char nruns = 0;
+  unsigned short* special = NULL;
+  // The worn page's items all stay where they are in the page
+  static const flashstore_reloc whole = { sizeof(flashpage_header), sizeof(flashpage_header) };
+
+  if (ram + wornlen + sizeof(flashpage_header) > ramend)
+  {
+    return;
+  }
+  for (ptr = FLASHPAGE_DATA(coldpage); (ptr <= coldpage + (FLASHSTORE_PAGESIZE-1)) && (ptr > coldpage); ptr += FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]))
+  {
+    unsigned short id = *(unsigned short*)ptr;
+    unsigned char itemlen = FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]);
+    if (id == FLASHID_FREE)
+    {
+      break;
+    }
+    else if (id != FLASHID_INVALID)
+    {
+      if (id == FLASHID_SPECIAL)
+      {
+        special = special ? special : (unsigned short*)(wornpage + coldlen);
+      }
+      else if (!nruns || runs->to - runs->from != coldlen - (ptr - coldpage))
+      {
+        runs--;
+        nruns++;
+        runs->from = ptr - coldpage;
+        runs->to = coldlen;
+      }
+      if ((unsigned char*)toworn + coldlen + itemlen > (unsigned char*)runs)
+      {
+        return;
+      }
+      OS_memcpy((unsigned char*)toworn + coldlen, ptr, itemlen);
+      coldlen += itemlen;
+    }
+  }
+  // The worn page was just compacted, so its items follow the header
+  OS_memcpy(ram + sizeof(flashpage_header), wornpage + sizeof(flashpage_header), wornlen - sizeof(flashpage_header));
+  tocold->erases = FLASHPAGE_ERASES(coldpage) + 1;
+  tocold->format = FLASHPAGE_FORMAT_ERASES;
+  tocold->moveto = FLASHPAGE_NOMOVE;
+  toworn->erases = FLASHPAGE_ERASES(wornpage) + 1;
+  toworn->format = FLASHPAGE_FORMAT_ERASES;
+  toworn->moveto = FLASHPAGE_NOMOVE;
+
+  CHECK_VDD();
+  OS_flashstore_erase(FLASHSTORE_FPAGE(coldpage));
+  tocold->age = ++lastage;
+  OS_flashstore_write(FLASHSTORE_FADDR(coldpage), (unsigned char*)tocold, FLASHSTORE_WORDS(wornlen));
+  CHECK_VDD();
+  OS_flashstore_erase(FLASHSTORE_FPAGE(wornpage));
+  toworn->age = ++lastage;
+  OS_flashstore_write(FLASHSTORE_FADDR(wornpage), (unsigned char*)toworn, FLASHSTORE_WORDS(coldlen));
+
+  // Every item on both pages moved
+  for (unsigned short** line = lineindexstart; line < lineindexend; line++)
+  {
+    unsigned short* moved = flashstore_relocated(*line, coldpage, wornpage, runs, nruns);
+    moved = moved ? moved : flashstore_relocated(*line, wornpage, coldpage, &whole, 1);
+    if (moved)
+    {
+      *line = moved;
+    }
+  }
+  orderedpages[cold].free = FLASHSTORE_PAGESIZE - wornlen;
+  orderedpages[cold].waste = 0;
+  orderedpages[cold].special = orderedpages[worn].special ? (unsigned short*)(coldpage + ((unsigned char*)orderedpages[worn].special - wornpage)) : NULL;
+  orderedpages[worn].free = FLASHSTORE_PAGESIZE - coldlen;
+  orderedpages[worn].waste = 0;
+  orderedpages[worn].special = special;
+}
+#endif
+
+void flashstore_compact(unsigned char len, unsigned char* tempmemstart, unsigned char* tempmemend)
+{
+  // The line index is patched as items move, so keep the memory used clear of it
+  if (tempmemstart < (unsigned char*)lineindexend)
+  {
+    tempmemstart = (unsigned char*)lineindexend;
+  }
+  unsigned short available =
+    ( (tempmemend - tempmemstart)  // free heap
+     + ((unsigned char*)lineindexend - (unsigned char*)lineindexstart) ); // optional index
+  //  & (unsigned short)(FLASHSTORE_PAGESIZE - 1);  // limit to page size
+  // Find the lowest age page which this will fit in, passing over worn pages
+  // while there are others.
+  static unsigned char pg;
+  static unsigned char selected;
+  static unsigned short occupied;
+  static flashpage_age age;
+  static unsigned char worn;
+  unsigned short coldest = 0xFFFF;
+  unsigned char coldpage = 0;
+  unsigned char* scratch = tempmemstart;
+  age = 0xFFFFFFFF;
+  worn = 1;
+  selected = 0;
+  len = FLASHSTORE_PADDEDSIZE(len);
+  if (available > FLASHSTORE_PAGESIZE)
+  {
+    available = FLASHSTORE_PAGESIZE;
+  }
+#if FLASHSTORE_COMPACT_STEP
+  // Finish the move under way, then a whole page can move into the reserve without
+  // needing the memory for it
+  while (victim != FLASHSTORE_NOPAGE)
+  {
+    flashstore_move(0, tempmemstart, tempmemend);
+  }
+  if (flashstore_findreserve())
+  {
+    available = FLASHSTORE_PAGESIZE;
+  }
+#endif
+  for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+  {
+#if FLASHSTORE_COMPACT_STEP
+    if (pg == reserve)
+    {
+      continue;
+    }
+#endif
+    if (FLASHPAGE_ERASES(FLASHSTORE_PAGEBASE(pg)) < coldest)
+    {
+      coldest = FLASHPAGE_ERASES(FLASHSTORE_PAGEBASE(pg));
+      coldpage = pg;
+    }
+  }
+  for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+  {
+#if FLASHSTORE_COMPACT_STEP
+    if (pg == reserve)
+    {
+      continue;
+    }
+#endif
+    flashpage_age cage = *(flashpage_age*)FLASHSTORE_PAGEBASE(pg);
+    unsigned char cworn = FLASHPAGE_ERASES(FLASHSTORE_PAGEBASE(pg)) - coldest >= FLASHSTORE_WEAR_SPREAD;
+    unsigned short cfree = orderedpages[pg].free + orderedpages[pg].waste;
+    if (((cworn < worn || (cworn == worn && cage < age)) && cage != 0xFFFFFFFF && cfree >= len)
+        && cfree <= available)
+    {
+      selected = pg;
+      age = cage;
+      worn = cworn;
+      occupied = FLASHSTORE_PAGESIZE - cfree;
+    }
+  }
+    
+#if FLASHSTORE_COMPACT_STEP
+  if (age == 0xFFFFFFFF && reserve != FLASHSTORE_NOPAGE)
+  {
+    // Only the reserve has room left, so give it up to the write
+    reserve = FLASHSTORE_NOPAGE;
+    return;
+  }
+#endif
+  // Need at least FLASHSTORE_PAGESIZE
+  if ( (occupied > available) || (age == 0xFFFFFFFF) )
+    return;
+  OS_STAT_INC(flash_compacts);
+    
+  // close access to the flash store
+  static halIntState_t intState;
+  HAL_ENTER_CRITICAL_SECTION(intState);
+#if FLASHSTORE_COMPACT_STEP
+  if (reserve != FLASHSTORE_NOPAGE)
+  {
+    victim = selected;
+    victimpos = FLASHPAGE_DATA(FLASHSTORE_PAGEBASE(selected)) - FLASHSTORE_PAGEBASE(selected);
+    while (victim != FLASHSTORE_NOPAGE)
+    {
+      flashstore_move(0, tempmemstart, tempmemend);
+    }
+#if FLASHSTORE_WEAR_SPREAD
+    // Static data keeps its page from being erased, move it onto the worn page just emptied
+    if (reserve == selected && coldpage != selected && FLASHPAGE_ERASES(FLASHSTORE_PAGEBASE(selected)) - coldest >= FLASHSTORE_WEAR_SPREAD)
+    {
+      victim = coldpage;
+      victimpos = FLASHPAGE_DATA(FLASHSTORE_PAGEBASE(coldpage)) - FLASHSTORE_PAGEBASE(coldpage);
+      while (victim != FLASHSTORE_NOPAGE)
+      {
+        flashstore_move(0, tempmemstart, tempmemend);
+      }
+    }
+#endif
+    HAL_EXIT_CRITICAL_SECTION(intState);
+    return;
+  }
+#endif
+  LINECACHE_FLUSH();
+  SPECIALDIR_FLUSH();
+  indexsaved = 0; // lastage moves on
+  
+  unsigned short heap_len = 0;
+  char corrupted = 0;
+  char compacted = 0;
+
+  if (occupied > tempmemend - tempmemstart)  
+  {
+    // use additionally index area for compacting
+    // by moving heap to to beginning
+    // Attention: this assumes that tempmemstart is the current heap end!
+    heap_len = tempmemstart - (unsigned char*)lineindexend;
+    tempmemstart = OS_memcpy((void*)lineindexstart, (void*)lineindexend, heap_len);
+    corrupted = 1; // since we use the index area it is definitly corrupted
+  }
+  
+  // Found enough space for the line, compact the page
+  // Copy required page data into RAM
+  unsigned char* ram = tempmemstart + sizeof(flashpage_header);
+  unsigned char* flash = (unsigned char*)FLASHSTORE_PAGEBASE(selected);
+  static unsigned char* ptr;
+  unsigned short mem_length = sizeof(flashpage_header);
+  // The lines' runs go down from the end of the memory
+  flashstore_reloc* runs = (flashstore_reloc*)tempmemend;
+  unsigned char nruns = 0;
+  unsigned short *special = 0;
+  for (ptr = FLASHPAGE_DATA(flash); (ptr <= flash + (FLASHSTORE_PAGESIZE-1)) && (ptr > flash); )
+  {
+    unsigned short id = *(unsigned short*)ptr;
+    unsigned char itemlen = FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]);
+    if (id == FLASHID_FREE)
+    {
+      // the rest of the page is empty
+      break;
+    }
+    else if (id != FLASHID_INVALID)
+    {
+      if (special == 0 && id == FLASHID_SPECIAL)
+      {
+        special = (unsigned short *)(flash + mem_length);
+      }
+      else if (id != FLASHID_SPECIAL && !corrupted && (!nruns || runs->to - runs->from != mem_length - (ptr - flash)))
+      {
+        runs--;
+        nruns++;
+        runs->from = ptr - flash;
+        runs->to = mem_length;
+      }
+      // Out of memory for the runs, so the index has to be rebuilt
+      corrupted |= ram + itemlen > (unsigned char*)runs;
+      if (mem_length + itemlen <= available)
+      {
+        ram = OS_memcpy(ram, ptr, itemlen);
+        mem_length += itemlen;
+      }
+      else 
+      {
+        corrupted = 1;
+        goto exit;   
+      } 
+    }
+    ptr += itemlen;
+  }
+  ((flashpage_header*)tempmemstart)->erases = FLASHPAGE_ERASES(flash) + 1;
+  ((flashpage_header*)tempmemstart)->format = FLASHPAGE_FORMAT_ERASES;
+  ((flashpage_header*)tempmemstart)->moveto = FLASHPAGE_NOMOVE;
+  CHECK_VDD();
+  // Erase the page
+  OS_flashstore_erase(FLASHSTORE_FPAGE(flash));
+  ((flashpage_header*)tempmemstart)->age = ++lastage;
+//  OS_flashstore_write(FLASHSTORE_FADDR(flash), (unsigned char*)&lastage, FLASHSTORE_WORDS(sizeof(lastage)));
+  orderedpages[selected].waste = 0;
+  orderedpages[selected].free = FLASHSTORE_PAGESIZE - mem_length; // - sizeof(flashpage_age);
+  orderedpages[selected].special = special;
+
+  // Copy the old lines back in.
+  //flash += sizeof(flashpage_age);
+  OS_flashstore_write(FLASHSTORE_FADDR(flash), tempmemstart, FLASHSTORE_WORDS(mem_length));
+  compacted = 1;
+exit:
+  if (corrupted)
+  {
+    if (heap_len)
+    {
+      // copy old heap data back into position before rebuilding the index
+      OS_memcpy((void*)lineindexend, (void*)lineindexstart, heap_len);
+    }
+    // We corrupted memory, so we need to reinitialize
+    flashstore_init((unsigned char**)lineindexstart);
+  }
+  else if (compacted)
+  {
+    for (unsigned short** line = lineindexstart; line < lineindexend; line++)
+    {
+      unsigned short* moved = flashstore_relocated(*line, flash, flash, runs, nruns);
+      if (moved)
+      {
+        *line = moved;
+      }
+    }
+  }
+#if FLASHSTORE_WEAR_SPREAD
+  // Static data keeps its page from being erased, move it to where the wear is
+  if (compacted && coldpage != selected && FLASHPAGE_ERASES(flash) - coldest >= FLASHSTORE_WEAR_SPREAD)
+  {
+    flashstore_swap(coldpage, selected, scratch, tempmemend);
+  }
+#endif
+  HAL_EXIT_CRITICAL_SECTION(intState); 
+}
+
+#if FLASHSTORE_COMPACT_STEP
+//
+// Bytes of valid items in a page.
+//
+static unsigned short flashpage_valid(unsigned char pg)
+{
+  const unsigned char* base = FLASHSTORE_PAGEBASE(pg);
+  return FLASHSTORE_PAGESIZE - (FLASHPAGE_DATA(base) - base) - orderedpages[pg].free - orderedpages[pg].waste;
+}
+
+//
+// Make sure there is a reserve, an erased page with nothing in it.
+//
+static unsigned char flashstore_findreserve(void)
+{
+  static unsigned char pg;
+
+  if (reserve != FLASHSTORE_NOPAGE && flashpage_valid(reserve) + orderedpages[reserve].waste)
+  {
+    reserve = FLASHSTORE_NOPAGE;
+  }
+  for (pg = 0; reserve == FLASHSTORE_NOPAGE && pg < FLASHSTORE_NRPAGES; pg++)
+  {
+    if (!flashpage_valid(pg))
+    {
+      reserve = pg;
+      if (orderedpages[pg].waste)
+      {
+        // Nothing valid left, so it only needs erasing
+        flashpage_erase(pg);
+      }
+    }
+  }
+  return reserve != FLASHSTORE_NOPAGE;
+}
+
+//
+// Pick the next page to compact into the reserve, making sure there is one.
+//  Returns 1 when there is work to do.
+//
+static unsigned char flashstore_compact_pick(void)
+{
+  static unsigned char pg;
+  unsigned short most = FLASHSTORE_COMPACT_WASTE - 1;
+
+  if (!flashstore_findreserve())
+  {
+    return 0;
+  }
+
+  // The page with the most waste, as long as its items fit
+  for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+  {
+    if (pg != reserve && orderedpages[pg].waste > most && flashpage_valid(pg) <= orderedpages[reserve].free)
+    {
+      most = orderedpages[pg].waste;
+      victim = pg;
+    }
+  }
+#if FLASHSTORE_WEAR_SPREAD
+  // Otherwise move the static data of the least worn page onto a worn reserve
+  if (victim == FLASHSTORE_NOPAGE)
+  {
+    unsigned short coldest = FLASHPAGE_ERASES(FLASHSTORE_PAGEBASE(reserve));
+    for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+    {
+      unsigned short erases = FLASHPAGE_ERASES(FLASHSTORE_PAGEBASE(pg));
+      if (erases + FLASHSTORE_WEAR_SPREAD <= coldest && flashpage_valid(pg) && flashpage_valid(pg) <= orderedpages[reserve].free)
+      {
+        coldest = erases;
+        victim = pg;
+      }
+    }
+  }
+#endif
+  if (victim == FLASHSTORE_NOPAGE)
+  {
+    return 0;
+  }
+  victimpos = FLASHPAGE_DATA(FLASHSTORE_PAGEBASE(victim)) - FLASHSTORE_PAGEBASE(victim);
+  return 1;
+}
+
+//
+// Copy an item between pages through ram..ramend, or a word at a time when it
+// doesn't fit there.
+//
+static void flashstore_copy(unsigned char* to, const unsigned char* from, unsigned char len, unsigned char* ram, unsigned char* ramend)
+{
+  static unsigned long word;
+  unsigned char room = len;
+  if (!ram || ram + len > ramend)
+  {
+    ram = (unsigned char*)&word;
+    room = sizeof(word);
+  }
+  for (unsigned char pos = 0; pos < len; pos += room)
+  {
+    OS_memcpy(ram, from + pos, room);
+    OS_flashstore_write(FLASHSTORE_FADDR(to + pos), ram, FLASHSTORE_WORDS(room));
+  }
+}
+
+//
+// The valid item in a page with the same id as the given one, or NULL.
+//
+static unsigned char* flashpage_find(unsigned char pg, const unsigned char* item)
+{
+  const unsigned char* base = FLASHSTORE_PAGEBASE(pg);
+  const unsigned char* end = base + FLASHSTORE_PAGESIZE - orderedpages[pg].free;
+  unsigned short id = *(unsigned short*)item;
+  for (unsigned char* ptr = FLASHPAGE_DATA(base); ptr < end; ptr += FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]))
+  {
+    if (*(unsigned short*)ptr == id &&
+        (id != FLASHID_SPECIAL || *(unsigned long*)(ptr + FLASHSPECIAL_ITEM_ID) == *(unsigned long*)(item + FLASHSPECIAL_ITEM_ID)))
+    {
+      return ptr;
+    }
+  }
+  return NULL;
+}
+
+// Point the line index at where a line of the victim moved to
+static void flashstore_relink(unsigned short id, unsigned short* mem)
+{
+  unsigned short** line = flashstore_findclosest(id);
+  const unsigned char* base = FLASHSTORE_PAGEBASE(victim);
+  if (line < lineindexend && (unsigned char*)*line >= base && (unsigned char*)*line < base + FLASHSTORE_PAGESIZE)
+  {
+    *line = mem;
+  }
+  indexsaved = 0;
+}
+
+//
+// Write the items gathered in ram to the end of the reserve. Their lines are
+// only relinked now, as the index is searched through the lines it points at.
+//
+static void flashstore_unstage(unsigned char* ram, unsigned short staged)
+{
+  unsigned char* mem = (unsigned char*)FLASHSTORE_PAGEBASE(reserve) + FLASHSTORE_PAGESIZE - orderedpages[reserve].free - staged;
+  OS_flashstore_write(FLASHSTORE_FADDR(mem), ram, FLASHSTORE_WORDS(staged));
+  for (unsigned short pos = 0; pos < staged; pos += FLASHSTORE_PADDEDSIZE(ram[pos + sizeof(unsigned short)]))
+  {
+    if (*(unsigned short*)(ram + pos) != FLASHID_SPECIAL)
+    {
+      flashstore_relink(*(unsigned short*)(ram + pos), (unsigned short*)(mem + pos));
+    }
+  }
+}
+
+//
+// Move the next count valid items of the victim into the reserve, and once
+// they have all gone erase the victim to be the next reserve. A count of 0
+// moves them all at once, gathering them in ram to write together, without
+// invalidating each as the erase follows.
+//
+static void flashstore_move(unsigned char count, unsigned char* ram, unsigned char* ramend)
+{
+  const unsigned char* base = FLASHSTORE_PAGEBASE(victim);
+  unsigned char copied = 0;
+  unsigned short staged = 0;
+
+  if (FLASHPAGE_HASERASES(base) && ((flashpage_header*)base)->moveto != reserve)
+  {
+    // Say where the items are going, in the header word after the age
+    static flashpage_header header;
+    OS_memcpy(&header, base, sizeof(header));
+    header.moveto = reserve;
+    OS_flashstore_write(FLASHSTORE_FADDR(base + sizeof(flashpage_age)), (unsigned char*)&header + sizeof(flashpage_age), FLASHSTORE_WORDS(sizeof(header) - sizeof(flashpage_age)));
+  }
+  while (!count || copied < count)
+  {
+    unsigned char* ptr = (unsigned char*)base + victimpos;
+    if (victimpos >= FLASHSTORE_PAGESIZE || *(unsigned short*)ptr == FLASHID_FREE)
+    {
+      // Everything has moved, the emptied page is the next reserve
+      if (staged)
+      {
+        flashstore_unstage(ram, staged);
+      }
+      flashpage_erase(victim);
+      reserve = victim;
+      victim = FLASHSTORE_NOPAGE;
+      return;
+    }
+    unsigned short id = *(unsigned short*)ptr;
+    unsigned char len = FLASHSTORE_PADDEDSIZE(ptr[sizeof(unsigned short)]);
+    if (!len)
+    {
+      // Corrupted, leave it for flashstore_init to sort out
+      if (staged)
+      {
+        flashstore_unstage(ram, staged);
+      }
+      COMPACT_ABANDON();
+      return;
+    }
+    if (id == FLASHID_INVALID)
+    {
+      victimpos += len;
+      continue;
+    }
+    if (recovering)
+    {
+      // Skip what was copied before the power failed, and copy what was cut short again
+      unsigned char* moved = flashpage_find(reserve, ptr);
+      if (moved && OS_memequal(moved, ptr, len))
+      {
+        victimpos += len;
+        continue;
+      }
+      if (moved)
+      {
+        flashstore_invalidate((unsigned short*)moved);
+      }
+    }
+    unsigned short* mem = (unsigned short*)(FLASHSTORE_PAGEBASE(reserve) + FLASHSTORE_PAGESIZE - orderedpages[reserve].free);
+    if (!count && ram && ramend - ram >= len)
+    {
+      if (staged + len > ramend - ram)
+      {
+        flashstore_unstage(ram, staged);
+        staged = 0;
+      }
+      OS_memcpy(ram + staged, ptr, len);
+      staged += len;
+    }
+    else
+    {
+      flashstore_copy((unsigned char*)mem, ptr, len, ram, ramend);
+      if (id != FLASHID_SPECIAL)
+      {
+        flashstore_relink(id, mem);
+      }
+    }
+    orderedpages[reserve].free -= len;
+    victimpos += len;
+    copied++;
+
+    if (id == FLASHID_SPECIAL)
+    {
+      if (!orderedpages[reserve].special)
+      {
+        orderedpages[reserve].special = mem;
+      }
+      if (orderedpages[victim].special == (unsigned short*)ptr)
+      {
+        orderedpages[victim].special = (unsigned short*)1;
+      }
+#if FLASHSTORE_SPECIALDIR_SIZE
+      unsigned long specialid = *(unsigned long*)(ptr + FLASHSPECIAL_ITEM_ID);
+      if (SPECIALDIR_HAS(specialid) && SPECIALDIR_SLOT(specialid) == (unsigned short*)ptr)
+      {
+        SPECIALDIR_SLOT(specialid) = mem;
+      }
+#endif
+    }
+    if (count)
+    {
+      flashstore_invalidate((unsigned short*)ptr);
+    }
+  }
+}
+
+//
+// Copy the next few items of the page being compacted into the reserve.
+//  Called from the idle task, returns 1 while there is more to do.
+//
+unsigned char flashstore_compact_step(void)
+{
+  if (interpreter_running)
+  {
+    // Never move lines under a running program, come back when it's done
+    return 1;
+  }
+  if (victim == FLASHSTORE_NOPAGE && !flashstore_compact_pick())
+  {
+    return 0;
+  }
+  OS_STAT_INC(compact_steps);
+  flashstore_move(FLASHSTORE_COMPACT_STEP, heap, sp);
+  return reserve != FLASHSTORE_NOPAGE;
+}
+
+//
+// Put the flash right after a power failure, before the pages are used. A page
+// which lost its header while being erased is erased again, and a page still
+// naming where its items were going has the rest of them moved there. Returns 1
+// when pages changed.
+//
+static unsigned char flashstore_recover(void)
+{
+  static unsigned char pg;
+  unsigned char recovered = 0;
+
+  for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+  {
+    if (*(flashpage_age*)FLASHSTORE_PAGEBASE(pg) == 0xFFFFFFFF)
+    {
+      flashpage_erase(pg);
+      recovered = 1;
+    }
+  }
+  for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+  {
+    const unsigned char* base = FLASHSTORE_PAGEBASE(pg);
+    if (FLASHPAGE_HASERASES(base) && ((flashpage_header*)base)->moveto < FLASHSTORE_NRPAGES)
+    {
+      reserve = ((flashpage_header*)base)->moveto;
+      victim = pg;
+      victimpos = sizeof(flashpage_header);
+      recovering = 1;
+      while (victim != FLASHSTORE_NOPAGE)
+      {
+        flashstore_move(0, NULL, NULL);
+      }
+      recovering = 0;
+      recovered = 1;
+    }
+  }
+  return recovered;
+}
+#endif
+
+//
+// Invalidate the line entry at the given address.
+//
+static void flashstore_invalidate(unsigned short* mem)
+{
+  static struct
+  {
+    unsigned short invalid;
+    unsigned char len;
+    unsigned char padding;
+  } invalid;
   OS_memcpy(&invalid, mem, sizeof(invalid));
+#if FLASHSTORE_SPECIALDIR_SIZE
+  if (invalid.invalid == FLASHID_SPECIAL)
+  {
+    unsigned long id = *(unsigned long*)((unsigned char*)mem + FLASHSPECIAL_ITEM_ID);
+    if (SPECIALDIR_HAS(id) && SPECIALDIR_SLOT(id) == mem)
+    {
+      SPECIALDIR_SLOT(id) = NULL;
+    }
+  }
+#endif
   invalid.invalid = FLASHID_INVALID;
 
   OS_flashstore_write(FLASHSTORE_FADDR(mem), (unsigned char*)&invalid, FLASHSTORE_WORDS(sizeof(invalid)));
 
-  orderedpages[((unsigned char*)mem - flashstore) / FLASHSTORE_PAGESIZE].waste += FLASHSTORE_PADDEDSIZE(invalid.len);
+  unsigned char pg = ((unsigned char*)mem - flashstore) / FLASHSTORE_PAGESIZE;
+  orderedpages[pg].waste += FLASHSTORE_PADDEDSIZE(invalid.len);
+#if FLASHSTORE_COMPACT_STEP
+  if (orderedpages[pg].waste >= FLASHSTORE_COMPACT_WASTE)
+  {
+    OS_flashstore_compact_wake();
+  }
+#endif
 }
 
 //
@@ -630,6 +1901,26 @@ unsigned char osal_snv_read(unsigned char id, unsigned char len, void *pBuf)
 }
 #endif
 
+#if (!defined(ENABLE_SNV) && !OAD_KEEP_NV_PAGES) || (ENABLE_SNV && !OAD_KEEP_NV_PAGES)
+unsigned char osal_snv_read_at(unsigned char id, unsigned char offset, unsigned char len, void *pBuf)
+{
+#if !GAP_BOND_MGR
+  return SUCCESS;
+#else
+  unsigned char* mem = flashstore_findspecial(FLASHSPECIAL_SNV + id);
+  if (mem && offset + len <= mem[FLASHSPECIAL_DATA_LEN] - FLASHSPECIAL_DATA_OFFSET)
+  {
+    OS_memcpy(pBuf, mem + FLASHSPECIAL_DATA_OFFSET + offset, len);
+    return SUCCESS;
+  }
+  else
+  {
+    return NV_OPER_FAILED;
+  }
+#endif
+}
+#endif
+
 #if (!defined(ENABLE_SNV) && !OAD_KEEP_NV_PAGES) || !OAD_KEEP_NV_PAGES && !ENABLE_SNV
 unsigned char osal_snv_write(unsigned char id, unsigned char len, void *pBuf)
 {  
@@ -54,6 +54,29 @@
 #define FEATURE_LAZY_INDEX TRUE
 #endif
 
+#ifndef FEATURE_COMPILE
+#define FEATURE_COMPILE TRUE
+#endif
+
+// Count statements and milliseconds per line (PROFILE ON|OFF|DUMP)
+#ifndef FEATURE_PROFILE
+#define FEATURE_PROFILE FALSE
+#endif
+
+// Record how far each event source's runs overrun the time slice (SLICES)
+#ifndef FEATURE_SLICE_STATS
+#define FEATURE_SLICE_STATS FALSE
+#endif
+
+// Dispatch statements through a table of label addresses (a GCC extension)
+#ifndef FEATURE_COMPUTED_GOTO
+#ifdef __GNUC__
+#define FEATURE_COMPUTED_GOTO TRUE
+#else
+#define FEATURE_COMPUTED_GOTO FALSE
+#endif
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // ASCII Characters
 #define CR	'\r'
@@ -133,6 +156,10 @@ static const char initmsg[]           = "BlueBasic " kVersion MSG_EXT;
 //static const char urlmsg[]            = "http://blog.xojs.org/bluebasic";
 static const char urlmsg[]            = kMfrName;
 static const char memorymsg[]         = " bytes free.";
+#if FEATURE_PROFILE
+static const char profilenomemmsg[]   = "No memory to profile.";
+#endif
+static const char flushlostmsg[]      = "File not written, flash full.";
 #endif
 
 #define VAR_TYPE    long int
@@ -194,13 +221,13 @@ enum
   // Keyword spacers - to add main keywords later without messing up the numbering below
   //
 
-  KW_SPACE0, // 169
-  KW_SPACE1,
-  KW_SPACE2,
-  KW_SPACE3,
-  KW_SPACE4,
-  KW_SPACE5,
-  KW_SPACE6,
+  KW_PROFILE, // 169
+  KW_SLICES,
+  KW_FLUSH,
+  KW_FSCK,
+  KW_MAP,
+  KW_NEXTREC,
+  KW_SEEK,
   KW_SPACE7, // 176
 
   // -----------------------
@@ -227,9 +254,10 @@ enum
   OP_RSHIFT,
   OP_UMINUS,
   
-  OP_SPACE0,
-  OP_SPACE1,
-  OP_SPACE2,
+  // Binary integer literals created by tokenize(): <token><value:1|2|4>
+  LIT_INT8,
+  LIT_INT16,
+  LIT_INT32,
   OP_SPACE3,
   
   // -----------------------
@@ -268,8 +296,8 @@ enum
   PM_OUTPUT,
   PM_RISING,
   PM_FALLING,
-  PM_SPACE0,
-  PM_SPACE1,
+  FS_DELTA,
+  FS_TIME,
   PM_TIMEOUT,
   PM_WAIT,
   PM_PULSE,
@@ -306,6 +334,8 @@ enum
   
   BLE_AUTH,
 
+  PR_DUMP,
+
   LAST_KEYWORD
 };
 
@@ -466,7 +496,7 @@ typedef struct
   char for_var;
   VAR_TYPE terminal;
   VAR_TYPE step;
-  unsigned char** line;
+  unsigned char** line; // first line of the loop body
 } for_frame;
 
 typedef struct
@@ -498,6 +528,37 @@ typedef struct
   LINENUM connect;
 } service_frame;
 
+typedef struct
+{
+  unsigned short line;    // index of the IF/ELIF/ELSE line
+  unsigned short target;  // index of the line where execution continues
+} block_entry;
+
+typedef struct
+{
+  frame_header header;
+  unsigned short count;
+  // .... block_entry[count] ...
+} blockmap_frame;
+
+typedef struct
+{
+  frame_header header;
+  // .... unsigned short offset[lines], bytecode_entry lists ...
+} bytecode_frame;
+
+typedef struct
+{
+  unsigned long hits;     // statements started on the line
+  unsigned long millis;   // time until the next statement started
+} profile_entry;
+
+typedef struct
+{
+  frame_header header;
+  // .... profile_entry[lines] ...
+} profile_frame;
+
 // Frame types
 enum
 {
@@ -505,7 +566,10 @@ enum
   FRAME_FOR_FLAG,
   FRAME_VARIABLE_FLAG,
   FRAME_EVENT_FLAG,
-  FRAME_SERVICE_FLAG
+  FRAME_SERVICE_FLAG,
+  FRAME_BLOCKMAP_FLAG,
+  FRAME_BYTECODE_FLAG,
+  FRAME_PROFILE_FLAG
 };
 
 // Stack clean up return types
@@ -523,7 +587,8 @@ enum
 enum
 {
   VAR_INT = 1,
-  VAR_DIM_BYTE
+  VAR_DIM_BYTE,
+  VAR_DIM_MAP   // read only, onto a file record
 };
 
 static __data unsigned char** lineptr;
@@ -540,14 +605,51 @@ static unsigned char* list_line;
 #endif
 static unsigned char** program_start;
 static LINENUM linenum;
+static blockmap_frame* blockmap;
+#if FEATURE_COMPILE
+static bytecode_frame* bytecode;
+#endif
+#if FEATURE_PROFILE
+#define PROFILE_NONE        0xFFFF
+#define PROFILE_DUMP_LINES  10
+static unsigned char profile_on;
+static profile_frame* profile;
+static unsigned short profile_line = PROFILE_NONE; // index of the line being timed
+static unsigned long profile_start;
+#endif
 
 static variable_frame normal_variable = { { FRAME_VARIABLE_FLAG, 0 }, VAR_INT, 0, 0, 0, NULL };
 
+// Nested interpreter runs, while any is under way flash items must stay put
+unsigned char interpreter_running;
+
 #if defined ENABLE_YIELD && ENABLE_YIELD
 static VAR_TYPE yield_time;
 unsigned short timeSlice = 20;
 #endif
 
+#if FEATURE_SLICE_STATS
+#if defined ENABLE_YIELD && ENABLE_YIELD
+#define SLICE_BUDGET  timeSlice
+#else
+#define SLICE_BUDGET  10 // the normal slice when there's no yielding
+#endif
+#define SLICE_BUCKETS 8
+typedef struct
+{
+  unsigned short runs;
+  unsigned short max;                     // longest overrun in ms
+  unsigned short overruns[SLICE_BUCKETS]; // runs over by 0, 1, 2-3, 4-7 ... 64+ ms
+} slice_stats;
+static slice_stats slices[SLICE_SOURCES];
+static unsigned char slice_yielded;       // source of the run which yielded
+static const char* const slice_names[SLICE_SOURCES] =
+{
+  "CONSOLE", "TIMER 0", "TIMER 1", "TIMER 2", "TIMER 3", "INTERRUPT", "SERIAL", "I2C",
+  "ONREAD", "ONWRITE", "ONCONNECT", "ONDISCOVER"
+};
+#endif
+
 #define VAR_COUNT 26
 #define VARIABLE_INT_ADDR(F)    (((VAR_TYPE*)variables_begin) + ((F) - 'A'))
 #define VARIABLE_INT_GET(F)     (*VARIABLE_INT_ADDR(F))
@@ -701,11 +803,88 @@ typedef struct
   unsigned char action;
   unsigned short record;
   unsigned char poffset;
+  unsigned char part;       // the part of a chained record read from
+  unsigned char tlen;       // bytes of time in front of each record, FS_TIME_LEN in a TIME file
   unsigned short modulo;
+  unsigned short count;
+  unsigned short metanext;  // the record the file's metadata says comes next
+  unsigned char* meta;      // where the metadata was written, NULL when there is none
+  unsigned long metastamp;  // and the flashstore_stamp() then
+#if FS_WRITE_BUFFER
+  unsigned char* wbuf;  // records waiting to be written, NULL when unbuffered
+  unsigned char wlen;
+  unsigned char* cbuf;  // a DELTA file's record last packed or unpacked, NULL when plain
+  unsigned char bcount; // records in the block being packed
+  unsigned short cnum;  // the record unpacked into cbuf
+  unsigned short cstart;  // the first record of the block it came from
+  unsigned char* cblock;  // where that block is, NULL when cbuf holds nothing
+  unsigned long cstamp;   // and the flashstore_stamp() then
+  unsigned char cpos;     // where the record after is in the block
+#endif
 } os_file_t;
 static os_file_t files[FS_NR_FILE_HANDLES];
+// The write buffer keeps room to write the metadata along with the records
+#define FS_WRITE_BUFFER_ALLOC (FS_WRITE_BUFFER + FLASHSTORE_PADDEDSIZE(FS_META_LEN))
+// A record held like an item, and whether one that long is packed
+#define FS_CODEC_BUF          (FLASHSPECIAL_DATA_OFFSET + FS_CODEC_RECORD)
+#define FS_CODEC_FITS(LEN)    ((LEN) <= FS_CODEC_RECORD && FLASHSPECIAL_DATA_OFFSET + FS_CODEC_MAXLEN(LEN) <= FS_WRITE_BUFFER)
+// The bytes of a chained record in each of its full parts
+#define FS_CHAIN_DATA         (FS_CHAIN_ITEMLEN - FLASHSPECIAL_DATA_OFFSET)
+// Whether time A is before time B, telling by their difference as MILLIS wraps round
+#define FS_TIME_BEFORE(A,B)   ((((A) - (B)) & 0xFFFFFFFF) >= 0x80000000)
+
+// file_flush modes
+#define FILE_FLUSH_COMPACT  0x01  // the free memory may be used to compact the flash
+#define FILE_FLUSH_FULL     0x02  // the buffer is full, and more records are coming
 
 static unsigned char addspecial_with_compact(unsigned char* item);
+static unsigned char* addspecials_with_compact(unsigned char* items, unsigned char len, unsigned char compact);
+static unsigned char file_write(os_file_t* file, unsigned char* item);
+static unsigned char file_chain(os_file_t* file, unsigned char* item, unsigned short len);
+static unsigned char file_metaat(os_file_t* file, unsigned char* ptr);
+static unsigned char file_writemeta(os_file_t* file, unsigned char compact);
+static void file_dropmeta(os_file_t* file);
+static unsigned short file_length(unsigned char filename);
+static unsigned char file_flush(os_file_t* file, unsigned char mode);
+static unsigned char file_sync(unsigned char filename);
+static unsigned char file_close(os_file_t* file);
+static unsigned char file_run(unsigned char filename, unsigned short record, unsigned char del);
+static unsigned char file_delete(unsigned char filename, unsigned short record);
+static unsigned char* file_find(os_file_t* file, unsigned short record);
+static unsigned char file_has(os_file_t* file, unsigned short record);
+static unsigned char* file_item(os_file_t* file);
+static unsigned char* file_nextpart(os_file_t* file, unsigned char* item, unsigned char part);
+static unsigned char* file_next(os_file_t* file, unsigned char* item);
+static unsigned char file_packed(unsigned char* meta);
+static unsigned char file_timed(unsigned char filename, unsigned char* meta);
+static unsigned char file_index(os_file_t* file, unsigned long time);
+static void file_seek(os_file_t* file, unsigned long time);
+#if FS_WRITE_BUFFER
+static void file_unbuffer(os_file_t* file);
+static unsigned char file_buffered(os_file_t* file, unsigned long id);
+#endif
+
+//
+// A mapped array (MAP #n, V) shows the record its file handle is at, where the
+// record is, so reading it needs no copy in RAM. The item is looked up again
+// once the handle moves on or the flash does. Of a chained record it shows the
+// part the handle is reading.
+//
+typedef struct
+{
+  variable_frame frame;
+  os_file_t* file;
+  unsigned char filename;
+  unsigned short record;
+  unsigned char part;
+  unsigned char* item;    // the record's item, NULL when there is none
+  unsigned long stamp;    // and the flashstore_stamp() when it was found
+} map_frame;
+static unsigned char* map_data(map_frame* map);
+static unsigned char map_size(map_frame* map);
+// An array's bytes, and how many there are
+#define VAR_DIM_DATA(F) ((F)->type == VAR_DIM_MAP ? map_data((map_frame*)(F)) : (unsigned char*)(F) + sizeof(variable_frame))
+#define VAR_DIM_SIZE(F) ((F)->type == VAR_DIM_MAP ? map_size((map_frame*)(F)) : (F)->header.frame_size - sizeof(variable_frame))
 
 #ifdef FEATURE_BOOST_CONVERTER
 //
@@ -732,13 +911,15 @@ static inline void ignore_blanks(void)
 // Tokenize the human readable command line into something easier, smaller and faster.
 //  Note. The tokenized form must always be smaller than the human form otherwise this
 //  will break because it overwrites the buffer as it goes along.
+//  Returns the position of the terminating NL (binary literals may contain NL bytes).
 //
-static void tokenize(void)
+static unsigned char* tokenize(void)
 {
   unsigned char c;
   unsigned char* writepos;
   unsigned char* readpos;
   unsigned char* scanpos;
+  unsigned char* literalend = NULL; // the last literal value byte may look like a space
   const unsigned char* table;
   
   writepos = txtpos;
@@ -775,7 +956,7 @@ static void tokenize(void)
       else if (c == NL)
       {
         *writepos = NL;
-        return;
+        return writepos;
       }
       while (c == *table)
       {
@@ -785,7 +966,7 @@ static void tokenize(void)
       if (*table >= 0x80)
       {
         // Match found
-        if (writepos > txtpos && writepos[-1] == WS_SPACE)
+        if (writepos > txtpos && writepos[-1] == WS_SPACE && writepos != literalend)
         {
           writepos--;
         }
@@ -794,6 +975,15 @@ static void tokenize(void)
         {
           *writepos++ = table[1];
         }
+        else if (*table == FUNC_HEX)
+        {
+          // Hex digits stay as text for FUNC_HEX
+          while ((void)(c = *readpos), (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))
+          {
+            *writepos++ = c;
+            readpos++;
+          }
+        }
         // Skip whitespace
         while ((void)(c = *readpos), c == WS_SPACE || c == WS_TAB)
         {
@@ -825,9 +1015,50 @@ static void tokenize(void)
               c = *++scanpos;
             } while (c >= 'A' && c <= 'Z');
           }
+          else if (c >= '0' && c <= '9')
+          {
+            // Number. Store it as a binary literal unless it is the line number,
+            // has leading zeros, or wouldn't become shorter.
+            unsigned char* numpos = scanpos;
+            unsigned long v = 0;
+            do
+            {
+              v = v * 10 + c - '0';
+              c = *++numpos;
+            } while (c >= '0' && c <= '9');
+            if (writepos == txtpos || numpos - scanpos < 2 || numpos - scanpos > 9 || *scanpos == '0')
+            {
+              while (scanpos < numpos)
+              {
+                *writepos++ = *scanpos++;
+              }
+            }
+            else
+            {
+              if (v < 0x100)
+              {
+                *writepos++ = LIT_INT8;
+                *writepos++ = (unsigned char)v;
+              }
+              else if (v < 0x10000)
+              {
+                *writepos++ = LIT_INT16;
+                *(unsigned short*)writepos = (unsigned short)v;
+                writepos += sizeof(unsigned short);
+              }
+              else
+              {
+                *writepos++ = LIT_INT32;
+                *(int32_t*)writepos = (int32_t)v;
+                writepos += sizeof(int32_t);
+              }
+              literalend = writepos;
+              scanpos = numpos;
+            }
+          }
           else if (c == WS_TAB || c == WS_SPACE)
           {
-            if (writepos > txtpos && writepos[-1] != WS_SPACE)
+            if (writepos > txtpos && (writepos[-1] != WS_SPACE || writepos == literalend))
             {
               *writepos++ = WS_SPACE;
             }
@@ -882,6 +1113,25 @@ void printnum(signed char fieldsize, VAR_TYPE num)
 }
 #endif
 
+//
+// Binary integer literals (see tokenize()).
+//
+#define IS_LITERAL(T)     ((T) >= LIT_INT8 && (T) <= LIT_INT32)
+#define LITERAL_SIZE(T)   (1 << ((T) - LIT_INT8))
+
+static VAR_TYPE literal_value(unsigned char token, const unsigned char* ptr)
+{
+  switch (token)
+  {
+    case LIT_INT8:
+      return *ptr;
+    case LIT_INT16:
+      return *(unsigned short*)ptr;
+    default:
+      return *(int32_t*)ptr;
+  }
+}
+
 #if ENABLE_BLE_CONSOLE
 static void testlinenum(void)
 {
@@ -889,6 +1139,15 @@ static void testlinenum(void)
 
   ignore_blanks();
 
+  // A number after a keyword, as LIST's, is a literal once tokenized
+  if (IS_LITERAL(*txtpos))
+  {
+    VAR_TYPE value = literal_value(*txtpos, txtpos + 1);
+    txtpos += 1 + LITERAL_SIZE(*txtpos);
+    linenum = value < 0 || value > 0xFFFF ? 0xFFFF : value;
+    return;
+  }
+
   linenum = 0;
   for (ch = *txtpos; ch >= '0' && ch <= '9'; ch = *++txtpos)
   {
@@ -1004,6 +1263,11 @@ static void printline(unsigned char nindent, unsigned char indent)
     {
       OS_putchar(c);
     }
+    else if (IS_LITERAL(c))
+    {
+      printnum(0, literal_value(c, list_line));
+      list_line += LITERAL_SIZE(c);
+    }
     else
     {
       // Decode the token (which is a bit non-trival and slow)
@@ -1118,7 +1382,7 @@ static unsigned char* get_variable_frame(char name, variable_frame** frame)
   {
     unsigned char* ptr = *(unsigned char**)VARIABLE_INT_ADDR(name);
     *frame = (variable_frame*)ptr;
-    return ptr + sizeof(variable_frame);
+    return VAR_DIM_DATA(*frame);
   }
   else
   {
@@ -1129,20 +1393,22 @@ static unsigned char* get_variable_frame(char name, variable_frame** frame)
 
 //
 // Parse the variable name and return a pointer to its memory and its size.
+// A mapped array is only parsed by parse_variable_view, for reading.
 //
-static unsigned char* parse_variable_address(variable_frame** vframe)
+static unsigned char* parse_variable_view(variable_frame** vframe)
 {
   ignore_blanks();
 
   const unsigned char name = *txtpos;
 
+  *vframe = NULL;
   if (name < 'A' || name > 'Z')
   {
     return NULL;
   }
   txtpos++;
   unsigned char* ptr = get_variable_frame(name, vframe);
-  if ((*vframe)->type == VAR_DIM_BYTE)
+  if ((*vframe)->type != VAR_INT)
   {
     VAR_TYPE index;   
 #if defined(FEATURE_LAZY_INDEX) && FEATURE_LAZY_INDEX
@@ -1153,12 +1419,17 @@ static unsigned char* parse_variable_address(variable_frame** vframe)
       index = parse_int(255, 10);
       error_num = ERROR_OK;
     }
+    else if (IS_LITERAL(*txtpos))
+    {
+      index = literal_value(*txtpos, txtpos + 1);
+      txtpos += 1 + LITERAL_SIZE(*txtpos);
+    }
     else
 #endif    
     {
       index = expression(EXPR_BRACES);
     }
-    if (error_num || index < 0 || index >= (*vframe)->header.frame_size - sizeof(variable_frame))
+    if (error_num || index < 0 || index >= VAR_DIM_SIZE(*vframe))
     {
 #if defined(FEATURE_LAZY_INDEX) && FEATURE_LAZY_INDEX
       txtpos = otxtpos;
@@ -1170,6 +1441,45 @@ static unsigned char* parse_variable_address(variable_frame** vframe)
   return ptr;
 }
 
+static unsigned char* parse_variable_address(variable_frame** vframe)
+{
+  unsigned char* ptr = parse_variable_view(vframe);
+  if (*vframe && (*vframe)->type == VAR_DIM_MAP)
+  {
+    *vframe = NULL;
+    return NULL;
+  }
+  return ptr;
+}
+
+static unsigned char* map_data(map_frame* map)
+{
+  os_file_t* file = map->file;
+  if (file->action != 'R' || file->filename != map->filename)
+  {
+    map->item = NULL;
+  }
+#if FS_WRITE_BUFFER
+  else if (!map->item || map->item == file->cbuf || map->record != file->record || map->part != file->part || map->stamp != flashstore_stamp() || *(unsigned short*)map->item != FLASHID_SPECIAL)
+#else
+  else if (!map->item || map->record != file->record || map->part != file->part || map->stamp != flashstore_stamp() || *(unsigned short*)map->item != FLASHID_SPECIAL)
+#endif
+  {
+    map->item = file_item(file);
+    map->record = file->record;
+    map->part = file->part;
+    map->stamp = flashstore_stamp();
+  }
+  // A record's time isn't part of its data
+  return map->item ? map->item + FLASHSPECIAL_DATA_OFFSET + (map->part ? 0 : file->tlen) : (unsigned char*)map;
+}
+
+static unsigned char map_size(map_frame* map)
+{
+  map_data(map);
+  return map->item ? map->item[FLASHSPECIAL_DATA_LEN] - FLASHSPECIAL_DATA_OFFSET - (map->part ? 0 : map->file->tlen) : 0;
+}
+
 //
 // copy variable content to dst and return its size
 //
@@ -1178,7 +1488,7 @@ static unsigned char copy_dim(unsigned char *dst)
 {
   variable_frame* vframe = NULL;
   unsigned char* otxtpos = txtpos;
-  unsigned char* ptr = parse_variable_address(&vframe);
+  unsigned char* ptr = parse_variable_view(&vframe);
   unsigned char len = 0;
   if (ptr)
   {
@@ -1191,9 +1501,9 @@ static unsigned char copy_dim(unsigned char *dst)
     // No address, but we have a vframe - this is a full array
     if (error_num == ERROR_EXPRESSION)
       error_num = ERROR_OK; // clear parsing error due to missing index braces
-    len = vframe->header.frame_size - sizeof(variable_frame);
+    len = VAR_DIM_SIZE(vframe);
     CHECK_HEAP_OOM(len, qoom);
-    OS_memcpy(dst, ((unsigned char*)vframe) + sizeof(variable_frame), len);
+    OS_memcpy(dst, VAR_DIM_DATA(vframe), len);
   }	
   return len;
 qoom:
@@ -1258,7 +1568,25 @@ static void clean_memory(void)
   // Reset variables to 0 and remove all types
   OS_memset(variables_begin, 0, VAR_COUNT * VAR_SIZE + 4);
   
-  // Reset file handles
+  // Reset file handles, writing out what they buffered. There's no memory to
+  // compact with when a line is being entered, so it must fit as it is.
+  for (unsigned char i = 0; i < FS_NR_FILE_HANDLES; i++)
+  {
+    if (!file_flush(&files[i], 0))
+    {
+      printmsg(flushlostmsg);
+    }
+#if FS_WRITE_BUFFER
+    if (files[i].wbuf)
+    {
+      OS_free(files[i].wbuf);
+    }
+    if (files[i].cbuf)
+    {
+      OS_free(files[i].cbuf);
+    }
+#endif
+  }
   OS_memset(files, 0, sizeof(files));
   
   // Stop timers
@@ -1295,9 +1623,133 @@ static void clean_memory(void)
     ptr += ((frame_header*)ptr)->frame_size;
   }
   heap = (unsigned char*)program_end;
+  blockmap = NULL;
+#if FEATURE_COMPILE
+  bytecode = NULL;
+#endif
+#if FEATURE_PROFILE
+  profile = NULL;
+  profile_line = PROFILE_NONE;
+#endif
   SET_MIN_MEMORY(sp - heap);
 }
 
+//
+// Scan forward from an IF/ELIF line to the ELSE, ELIF or END where execution continues
+// when its condition is false, or from an ELSE line to its END.
+// Returns program_end if the block is never closed.
+//
+static unsigned char** block_scan(unsigned char** line)
+{
+  unsigned char nest = 0;
+  unsigned char skip_elif = ((*line)[sizeof(LINENUM) + sizeof(char)] == KW_ELSE);
+
+  while (++line < program_end)
+  {
+    switch ((*line)[sizeof(LINENUM) + sizeof(char)])
+    {
+      case KW_IF:
+        nest++;
+        break;
+      case KW_ELSE:
+      case KW_ELIF:
+        if (!nest && !skip_elif)
+        {
+          return line;
+        }
+        break;
+      case KW_END:
+        if (!nest)
+        {
+          return line;
+        }
+        nest--;
+        break;
+      default:
+        break;
+    }
+  }
+  return program_end;
+}
+
+//
+// Find where execution continues after skipping the block at 'line'.
+// The targets of all IF/ELIF/ELSE lines are computed on first use after RUN and
+// kept in the heap until the program is changed. If that would take more than a
+// quarter of the free memory we fall back to scanning.
+//
+static unsigned char** block_skip(unsigned char** line)
+{
+  if (line >= program_end)
+  {
+    return program_end;
+  }
+  if (!blockmap)
+  {
+    unsigned short count = 0;
+    unsigned char** ptr;
+
+    for (ptr = program_start; ptr < program_end; ptr++)
+    {
+      unsigned char kw = (*ptr)[sizeof(LINENUM) + sizeof(char)];
+      if (kw == KW_IF || kw == KW_ELIF || kw == KW_ELSE)
+      {
+        count++;
+      }
+    }
+    unsigned short size = sizeof(blockmap_frame) + count * sizeof(block_entry);
+    if (size > (sp - heap) / 4)
+    {
+      blockmap = (blockmap_frame*)1;
+    }
+    else
+    {
+      blockmap = (blockmap_frame*)heap;
+      heap += size;
+      CHECK_MIN_MEMORY();
+      blockmap->header.frame_type = FRAME_BLOCKMAP_FLAG;
+      blockmap->header.frame_size = size;
+      blockmap->count = count;
+      block_entry* entry = (block_entry*)(blockmap + 1);
+      for (ptr = program_start; ptr < program_end; ptr++)
+      {
+        unsigned char kw = (*ptr)[sizeof(LINENUM) + sizeof(char)];
+        if (kw == KW_IF || kw == KW_ELIF || kw == KW_ELSE)
+        {
+          entry->line = ptr - program_start;
+          entry->target = block_scan(ptr) - program_start;
+          entry++;
+        }
+      }
+    }
+  }
+  if (blockmap != (blockmap_frame*)1)
+  {
+    // Entries are in line order
+    block_entry* entry = (block_entry*)(blockmap + 1);
+    unsigned short index = line - program_start;
+    unsigned short lo = 0;
+    unsigned short hi = blockmap->count;
+    while (lo < hi)
+    {
+      unsigned short mid = (lo + hi) >> 1;
+      if (entry[mid].line < index)
+      {
+        lo = mid + 1;
+      }
+      else if (entry[mid].line > index)
+      {
+        hi = mid;
+      }
+      else
+      {
+        return program_start + entry[mid].target;
+      }
+    }
+  }
+  return block_scan(line);
+}
+
 // -------------------------------------------------------------------------------------------
 //
 // Expression evaluator
@@ -1384,10 +1836,133 @@ expr_div0:
   return NULL;
 }
 
-static VAR_TYPE expression(unsigned char mode)
+#if FEATURE_COMPILE
+// -------------------------------------------------------------------------------------------
+//
+// Expression compiler
+//
+// On RUN the expressions of assignments and IF/ELIF conditions are compiled into postfix
+// bytecode held in a heap frame. expression() runs the bytecode when there is an entry for
+// the current position, and falls back to parsing the text otherwise.
+//
+// The compiler mirrors the parse expression() makes, so the bytecode applies operators in
+// exactly the same order. Whether a variable is a DIM is only known when the code runs, so
+// the bytecode checks each variable and gives up if the assumption was wrong (or on any
+// error) so the text evaluator can produce the proper result or error.
+// Constant subexpressions are evaluated while compiling; the program text (and so LIST)
+// is never changed.
+//
+// -------------------------------------------------------------------------------------------
+
+// Bytecode: 'A'-'Z' push variable, 'a'-'z' index DIM variable, OP_xxx operators.
+enum
+{
+  BC_END = 0,
+  BC_NUM8,  // <value:1>
+  BC_NUM,   // <value:VAR_TYPE>
+};
+
+// Each line has a list of entries: <pos><mode><end><size><bytecode...>, ending with a 0
+#define BC_ENTRY_POS      0
+#define BC_ENTRY_MODE     1
+#define BC_ENTRY_END      2
+#define BC_ENTRY_SIZE     3
+#define BC_ENTRY_CODE     4
+
+static unsigned char* bytecode_number(unsigned char* code, VAR_TYPE value)
+{
+  if (value >= 0 && value <= 255)
+  {
+    *code++ = BC_NUM8;
+    *code++ = value;
+  }
+  else
+  {
+    *code++ = BC_NUM;
+    OS_memcpy(code, &value, sizeof(VAR_TYPE));
+    code += sizeof(VAR_TYPE);
+  }
+  return code;
+}
+
+//
+// Is the code from 'item' to 'end' a single number?
+//
+static unsigned char bytecode_constant(const unsigned char* item, const unsigned char* end, VAR_TYPE* value)
+{
+  if (*item == BC_NUM8 && item + 2 == end)
+  {
+    *value = item[1];
+    return 1;
+  }
+  if (*item == BC_NUM && item + 1 + sizeof(VAR_TYPE) == end)
+  {
+    OS_memcpy(value, item + 1, sizeof(VAR_TYPE));
+    return 1;
+  }
+  return 0;
+}
+
+//
+// Emit operator 'op', as expression_operate() would apply it to a queue of 'queued' values
+// whose code starts at 'operand'.
+// Operators on constants are folded, and multiplies by a power of two become shifts.
+//
+static unsigned char* bytecode_operate(unsigned char op, unsigned char* code, unsigned char** operand, unsigned char* queued)
+{
+  VAR_TYPE value[2];
+
+  if (op < OP_ADD || op > OP_UMINUS || *queued < (op == OP_UMINUS ? 1 : 2))
+  {
+    return NULL;
+  }
+  if (op == OP_UMINUS)
+  {
+    unsigned char* item = operand[*queued - 1];
+    if (bytecode_constant(item, code, &value[0]))
+    {
+      expression_operate(op, value + 1);
+      return bytecode_number(item, value[0]);
+    }
+  }
+  else
+  {
+    unsigned char* left = operand[*queued - 2];
+    unsigned char* right = operand[*queued - 1];
+    (*queued)--;
+    if (bytecode_constant(right, code, &value[1]))
+    {
+      if (bytecode_constant(left, right, &value[0]))
+      {
+        if (expression_operate(op, value + 2))
+        {
+          return bytecode_number(left, value[0]);
+        }
+        // Leave the error to run time
+        error_num = ERROR_OK;
+      }
+      else if (op == OP_MUL && value[1] > 1 && !(value[1] & (value[1] - 1)))
+      {
+        unsigned char shift = 0;
+        while (value[1] >>= 1)
+        {
+          shift++;
+        }
+        code = bytecode_number(right, shift);
+        op = OP_LSHIFT;
+      }
+    }
+  }
+  *code++ = op;
+  return code;
+}
+
+//
+// Compile the expression at txtpos. Returns the end of the generated code, or NULL
+// if the expression is left to the text evaluator.
+//
+static unsigned char* bytecode_compile(unsigned char mode, unsigned char* code, unsigned char* codeend)
 {
-  VAR_TYPE queue[EXPRESSION_QUEUE_SIZE];
-  VAR_TYPE* queueend = &queue[EXPRESSION_QUEUE_SIZE];
   struct stack_t
   {
     unsigned char op;
@@ -1395,14 +1970,670 @@ static VAR_TYPE expression(unsigned char mode)
   };
   struct stack_t stack[EXPRESSION_STACK_SIZE];
   struct stack_t* stackend = &stack[EXPRESSION_STACK_SIZE];
+  struct stack_t* stackptr = stack;
+  unsigned char* operand[EXPRESSION_QUEUE_SIZE];
+  unsigned char queued = 0;
   unsigned char lastop = 1;
+  unsigned char op;
 
-  // Done parse if we have a pending error
-  if (error_num)
+  for (;;)
   {
-    return 0;
-  }
+    // Room for the most we emit in one go: a number and index, or the pending operators
+    if (code + sizeof(VAR_TYPE) + EXPRESSION_STACK_SIZE + 2 > codeend)
+    {
+      return NULL;
+    }
+    op = *txtpos++;
+    switch (op)
+    {
+      case WS_SPACE:
+        continue;
+
+      case NL:
+        txtpos--;
+        goto done;
+
+      default:
+        if (op >= '0' && op <= '9')
+        {
+          if (queued == EXPRESSION_QUEUE_SIZE)
+          {
+            return NULL;
+          }
+          operand[queued] = code;
+          if (*txtpos >= '0' && *txtpos <= '9')
+          {
+            txtpos--;
+            code = bytecode_number(code, parse_int(255, 10));
+            error_num = ERROR_OK;
+          }
+          else
+          {
+            code = bytecode_number(code, op - '0');
+          }
+          queued++;
+          lastop = 0;
+        }
+        else if (op >= 'A' && op <= 'Z')
+        {
+          if (*txtpos == '(')
+          {
+            // Assume a DIM: indexed when the ')' is reached
+            if (stackptr + 1 >= stackend)
+            {
+              return NULL;
+            }
+            (stackptr++)->op = op;
+            lastop = 1;
+            break;
+          }
+          if (queued == EXPRESSION_QUEUE_SIZE)
+          {
+            return NULL;
+          }
+          operand[queued] = code;
+#if defined(FEATURE_LAZY_INDEX) && FEATURE_LAZY_INDEX
+          if ((*txtpos >= '0' && *txtpos <= '9') || IS_LITERAL(*txtpos))
+          {
+            // Assume a DIM with an index without braces
+            if (stackptr + 1 >= stackend)
+            {
+              return NULL;
+            }
+            if (IS_LITERAL(*txtpos))
+            {
+              code = bytecode_number(code, literal_value(*txtpos, txtpos + 1));
+              txtpos += 1 + LITERAL_SIZE(*txtpos);
+            }
+            else
+            {
+              code = bytecode_number(code, parse_int(255, 10));
+              error_num = ERROR_OK;
+            }
+            *code++ = op - 'A' + 'a';
+          }
+          else
+#endif
+          {
+            *code++ = op;
+          }
+          queued++;
+          lastop = 0;
+        }
+        else if (op < 0x80)
+        {
+          txtpos--;
+          goto done;
+        }
+        else
+        {
+          // Functions and anything else we don't compile
+          return NULL;
+        }
+        break;
+
+      case KW_CONSTANT:
+        if (queued == EXPRESSION_QUEUE_SIZE)
+        {
+          return NULL;
+        }
+        operand[queued] = code;
+        code = bytecode_number(code, constantmap[*txtpos++ - CO_TRUE]);
+        queued++;
+        lastop = 0;
+        break;
+
+      case LIT_INT8:
+      case LIT_INT16:
+      case LIT_INT32:
+        if (queued == EXPRESSION_QUEUE_SIZE)
+        {
+          return NULL;
+        }
+        operand[queued] = code;
+        code = bytecode_number(code, literal_value(op, txtpos));
+        txtpos += LITERAL_SIZE(op);
+        queued++;
+        lastop = 0;
+        break;
+
+      case '(':
+        if (stackptr == stackend)
+        {
+          return NULL;
+        }
+        stackptr->depth = queued;
+        (stackptr++)->op = op;
+        lastop = 1;
+        break;
+
+      case ',':
+        for (;;)
+        {
+          if (stackptr == stack)
+          {
+            if (mode == EXPR_COMMA)
+            {
+              goto done;
+            }
+            return NULL;
+          }
+          op = (--stackptr)->op;
+          if (op == '(')
+          {
+            stackptr++;
+            break;
+          }
+          if (!(code = bytecode_operate(op, code, operand, &queued)))
+          {
+            return NULL;
+          }
+        }
+        lastop = 0;
+        break;
+
+      case ')':
+      {
+        unsigned char depth = 0;
+        for (;;)
+        {
+          if (stackptr == stack)
+          {
+            return NULL;
+          }
+          op = (--stackptr)->op;
+          if (op == '(')
+          {
+            depth = queued - stackptr->depth;
+            if (stackptr == stack && mode == EXPR_BRACES)
+            {
+              goto done;
+            }
+            break;
+          }
+          if (!(code = bytecode_operate(op, code, operand, &queued)))
+          {
+            return NULL;
+          }
+        }
+        if (stackptr > stack)
+        {
+          op = (--stackptr)->op;
+          if (depth != 1)
+          {
+            // Functions and POW
+            return NULL;
+          }
+          if (op >= 'A' && op <= 'Z')
+          {
+            *code++ = op - 'A' + 'a';
+          }
+          else
+          {
+            stackptr++;
+          }
+          lastop = 1;
+        }
+        break;
+      }
+
+      case OP_SUB:
+        if (lastop)
+        {
+          op = OP_UMINUS;
+        }
+        // Fall through
+      case OP_ADD:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_REM:
+      case OP_AND:
+      case OP_OR:
+      case OP_XOR:
+      case OP_GE:
+      case OP_NE:
+      case OP_GT:
+      case OP_EQEQ:
+      case OP_EQ:
+      case OP_LE:
+      case OP_LT:
+      case OP_NE_BANG:
+      case OP_LSHIFT:
+      case OP_RSHIFT:
+        while (stackptr != stack)
+        {
+          const unsigned char op2 = stackptr[-1].op - OP_ADD;
+          if (op2 >= sizeof(operator_precedence) || operator_precedence[op - OP_ADD] < operator_precedence[op2])
+          {
+            break;
+          }
+          if (!(code = bytecode_operate((--stackptr)->op, code, operand, &queued)))
+          {
+            return NULL;
+          }
+        }
+        if (stackptr == stackend)
+        {
+          return NULL;
+        }
+        (stackptr++)->op = op;
+        lastop = 1;
+        break;
+    }
+  }
+done:
+  while (stackptr > stack)
+  {
+    if (!(code = bytecode_operate((--stackptr)->op, code, operand, &queued)))
+    {
+      return NULL;
+    }
+  }
+  if (queued != 1)
+  {
+    return NULL;
+  }
+  *code++ = BC_END;
+  return code;
+}
+
+//
+// Run compiled code. Returns 0 if the text evaluator must be used instead.
+//
+static unsigned char bytecode_run(const unsigned char* code, VAR_TYPE* result)
+{
+  VAR_TYPE queue[EXPRESSION_QUEUE_SIZE];
+  VAR_TYPE* queueptr = queue;
+  unsigned char vname;
+
+  for (;;)
+  {
+    unsigned char op = *code++;
+    switch (op)
+    {
+      case BC_END:
+        *result = queue[0];
+        return 1;
+
+      case BC_NUM8:
+        *queueptr++ = *code++;
+        break;
+
+      case BC_NUM:
+        OS_memcpy(queueptr++, code, sizeof(VAR_TYPE));
+        code += sizeof(VAR_TYPE);
+        break;
+
+      default:
+        if (op >= 'A' && op <= 'Z')
+        {
+          if (!VARIABLE_IS_EXTENDED(op))
+          {
+            *queueptr++ = VARIABLE_INT_GET(op);
+          }
+          else
+          {
+            variable_frame* frame;
+            unsigned char* ptr = get_variable_frame(op, &frame);
+            if (frame->type != VAR_INT)
+            {
+              return 0;
+            }
+            *queueptr++ = *(VAR_TYPE*)ptr;
+          }
+        }
+        else if (op >= 'a' && op <= 'z')
+        {
+          variable_frame* frame;
+          unsigned char* ptr = get_variable_frame(op - 'a' + 'A', &frame);
+          const VAR_TYPE top = queueptr[-1];
+          if (frame->type == VAR_INT || top < 0 || top >= VAR_DIM_SIZE(frame))
+          {
+            return 0;
+          }
+          queueptr[-1] = ptr[top];
+        }
+        else if (!(queueptr = expression_operate(op, queueptr)))
+        {
+          error_num = ERROR_OK;
+          return 0;
+        }
+        break;
+    }
+  }
+}
+
+//
+// Compile the expression at txtpos into an entry at 'code'. On success txtpos is left
+// at the end of the expression.
+//
+static unsigned char* bytecode_add(unsigned char* line, unsigned char mode, unsigned char* code, unsigned char* codeend)
+{
+  unsigned char* end;
+
+  if (code + BC_ENTRY_CODE > codeend)
+  {
+    return NULL;
+  }
+  code[BC_ENTRY_POS] = txtpos - line;
+  code[BC_ENTRY_MODE] = mode;
+  end = bytecode_compile(mode, code + BC_ENTRY_CODE, codeend);
+  if (!end || end - code > 255)
+  {
+    return NULL;
+  }
+  code[BC_ENTRY_END] = txtpos - line;
+  code[BC_ENTRY_SIZE] = end - code;
+  return end;
+}
+
+//
+// Compile the program. The bytecode may use up to a quarter of the free memory; lines
+// which don't fit are interpreted from the text.
+//
+static void bytecode_build(void)
+{
+  unsigned short lines = program_end - program_start;
+  unsigned char* limit = heap + (sp - heap) / 4;
+  unsigned short* offsets = (unsigned short*)(heap + sizeof(bytecode_frame));
+  unsigned char* code = (unsigned char*)(offsets + lines);
+  unsigned char* otxtpos = txtpos;
+
+  if (code > limit)
+  {
+    bytecode = (bytecode_frame*)1;
+    return;
+  }
+  bytecode = (bytecode_frame*)heap;
+  for (unsigned short i = 0; i < lines; i++)
+  {
+    unsigned char* line = program_start[i];
+    unsigned char* start = code;
+    unsigned char* end;
+
+    offsets[i] = 0;
+    txtpos = line + sizeof(LINENUM) + sizeof(char);
+    if (*txtpos == KW_IF || *txtpos == KW_ELIF)
+    {
+      txtpos++;
+      if ((end = bytecode_add(line, EXPR_NORMAL, code, limit - 1)))
+      {
+        code = end;
+      }
+    }
+    else if (*txtpos >= 'A' && *txtpos <= 'Z')
+    {
+      // Assignment, with an optional index
+      unsigned char assign = 1;
+      txtpos++;
+      if (*txtpos == '(')
+      {
+        if ((end = bytecode_add(line, EXPR_BRACES, code, limit - 1)))
+        {
+          code = end;
+        }
+        else
+        {
+          assign = 0;
+        }
+      }
+#if defined(FEATURE_LAZY_INDEX) && FEATURE_LAZY_INDEX
+      else if (IS_LITERAL(*txtpos))
+      {
+        txtpos += 1 + LITERAL_SIZE(*txtpos);
+      }
+      else
+      {
+        while (*txtpos >= '0' && *txtpos <= '9')
+        {
+          txtpos++;
+        }
+      }
+#endif
+      if (assign && *txtpos == OP_EQ)
+      {
+        txtpos++;
+        if ((end = bytecode_add(line, EXPR_NORMAL, code, limit - 1)))
+        {
+          code = end;
+        }
+      }
+    }
+    if (code != start)
+    {
+      *code++ = 0;
+      offsets[i] = start - heap;
+    }
+  }
+  txtpos = otxtpos;
+
+  bytecode->header.frame_type = FRAME_BYTECODE_FLAG;
+  bytecode->header.frame_size = code - heap;
+  heap = code;
+  CHECK_MIN_MEMORY();
+}
+
+//
+// Find and run the compiled code for the expression at txtpos.
+//
+static unsigned char bytecode_expression(unsigned char mode, VAR_TYPE* result)
+{
+  unsigned char* line = *lineptr;
+  unsigned short offset = ((unsigned short*)(bytecode + 1))[lineptr - program_start];
+
+  if (offset && txtpos > line && txtpos < line + line[sizeof(LINENUM)])
+  {
+    const unsigned char pos = txtpos - line;
+    for (unsigned char* entry = (unsigned char*)bytecode + offset; entry[BC_ENTRY_POS]; entry += entry[BC_ENTRY_SIZE])
+    {
+      if (entry[BC_ENTRY_POS] == pos)
+      {
+        if (entry[BC_ENTRY_MODE] == mode && bytecode_run(entry + BC_ENTRY_CODE, result))
+        {
+          txtpos = line + entry[BC_ENTRY_END];
+          return 1;
+        }
+        break;
+      }
+    }
+  }
+  return 0;
+}
+#endif // FEATURE_COMPILE
+
+#if FEATURE_PROFILE
+//
+// Charge the time since the timed statement started to its line.
+//
+static void profile_charge(unsigned long now)
+{
+  if (profile_line != PROFILE_NONE)
+  {
+    ((profile_entry*)(profile + 1))[profile_line].millis += now - profile_start;
+    profile_line = PROFILE_NONE;
+  }
+}
+
+//
+// Count the statement starting on the current line and time it until the next one.
+// The table has an entry per program line and is made on first use; it may take
+// half the free memory as it's only there while profiling.
+//
+static void profile_statement(void)
+{
+  if (!profile)
+  {
+    unsigned short size = sizeof(profile_frame) + (program_end - program_start) * sizeof(profile_entry);
+    if (size > (sp - heap) / 2)
+    {
+      // Say so once, the run goes on unprofiled
+      profile = (profile_frame*)1;
+      printmsg(profilenomemmsg);
+    }
+    else
+    {
+      profile = (profile_frame*)heap;
+      heap += size;
+      CHECK_MIN_MEMORY();
+      OS_memset(profile, 0, size);
+      profile->header.frame_type = FRAME_PROFILE_FLAG;
+      profile->header.frame_size = size;
+    }
+  }
+  if (profile != (profile_frame*)1)
+  {
+    const unsigned long now = OS_get_millis();
+    profile_charge(now);
+    profile_line = lineptr - program_start;
+    ((profile_entry*)(profile + 1))[profile_line].hits++;
+    profile_start = now;
+  }
+}
+
+//
+// Order lines most time first, then most statements, then by line number.
+//
+static unsigned char profile_hotter(unsigned short a, unsigned short b)
+{
+  profile_entry* entry = (profile_entry*)(profile + 1);
+
+  if (entry[a].millis != entry[b].millis)
+  {
+    return entry[a].millis > entry[b].millis;
+  }
+  if (entry[a].hits != entry[b].hits)
+  {
+    return entry[a].hits > entry[b].hits;
+  }
+  return a < b;
+}
+
+//
+// Print the hottest lines. There's no memory to sort in, so pick each line in turn.
+//
+static void profile_dump(void)
+{
+  profile_entry* entry = (profile_entry*)(profile + 1);
+  const unsigned short count = program_end - program_start;
+  unsigned short last = PROFILE_NONE;
+
+  printmsg("  LINE      HITS    MILLIS");
+  for (unsigned char n = PROFILE_DUMP_LINES; n; n--)
+  {
+    unsigned short best = PROFILE_NONE;
+    for (unsigned short i = 0; i < count; i++)
+    {
+      if (entry[i].hits && (last == PROFILE_NONE || profile_hotter(last, i)) && (best == PROFILE_NONE || profile_hotter(i, best)))
+      {
+        best = i;
+      }
+    }
+    if (best == PROFILE_NONE)
+    {
+      break;
+    }
+    printnum(5, *(LINENUM*)program_start[best]);
+    printnum(9, entry[best].hits);
+    printnum(9, entry[best].millis);
+    OS_putchar(NL);
+    last = best;
+  }
+}
+#endif // FEATURE_PROFILE
+
+#if FEATURE_SLICE_STATS
+//
+// Add a run of the interpreter to its source's statistics. Counts stick at their maximum.
+//
+static void slice_record(unsigned char source, unsigned long elapsed)
+{
+  slice_stats* stats = &slices[source];
+  const unsigned long over = elapsed > SLICE_BUDGET ? elapsed - SLICE_BUDGET : 0;
+  unsigned char bucket;
+
+  for (bucket = 0; bucket < SLICE_BUCKETS - 1 && (over >> bucket); bucket++)
+    ;
+  if (stats->runs != 0xFFFF)
+  {
+    stats->runs++;
+  }
+  if (stats->overruns[bucket] != 0xFFFF)
+  {
+    stats->overruns[bucket]++;
+  }
+  if (over > stats->max)
+  {
+    stats->max = over > 0xFFFF ? 0xFFFF : over;
+  }
+}
+
+//
+// Print the statistics of every source which ran.
+//
+static void slice_dump(void)
+{
+  printnum(0, SLICE_BUDGET);
+  printmsg(" ms time slice.");
+  printmsg("SOURCE      RUNS   MAX     0     1     2     4     8    16    32    64");
+  for (unsigned char source = 0; source < SLICE_SOURCES; source++)
+  {
+    slice_stats* stats = &slices[source];
+    if (stats->runs)
+    {
+      const char* name = slice_names[source];
+      unsigned char len;
+      for (len = 0; name[len]; len++)
+      {
+        OS_putchar(name[len]);
+      }
+      for (; len < 10; len++)
+      {
+        OS_putchar(WS_SPACE);
+      }
+      printnum(5, stats->runs);
+      printnum(5, stats->max);
+      for (unsigned char bucket = 0; bucket < SLICE_BUCKETS; bucket++)
+      {
+        printnum(5, stats->overruns[bucket]);
+      }
+      OS_putchar(NL);
+    }
+  }
+}
+#endif // FEATURE_SLICE_STATS
+
+static VAR_TYPE expression(unsigned char mode)
+{
+  VAR_TYPE queue[EXPRESSION_QUEUE_SIZE];
+  VAR_TYPE* queueend = &queue[EXPRESSION_QUEUE_SIZE];
+  struct stack_t
+  {
+    unsigned char op;
+    unsigned char depth;
+  };
+  struct stack_t stack[EXPRESSION_STACK_SIZE];
+  struct stack_t* stackend = &stack[EXPRESSION_STACK_SIZE];
+  unsigned char lastop = 1;
+
+  OS_STAT_INC(expressions);
+
+  // Done parse if we have a pending error
+  if (error_num)
+  {
+    return 0;
+  }
   
+#if FEATURE_COMPILE
+  if (bytecode && bytecode != (bytecode_frame*)1 && lineptr < program_end)
+  {
+    VAR_TYPE val;
+    if (bytecode_expression(mode, &val))
+    {
+      return val;
+    }
+  }
+#endif
+
   VAR_TYPE* queueptr = queue;
   struct stack_t* stackptr = stack;
 
@@ -1427,9 +2658,17 @@ static VAR_TYPE expression(unsigned char mode)
           {
             goto expr_oom;
           }
-          txtpos--;
-          *queueptr++ = parse_int(255, 10);
-          error_num = ERROR_OK;
+          if (*txtpos >= '0' && *txtpos <= '9')
+          {
+            txtpos--;
+            *queueptr++ = parse_int(255, 10);
+            error_num = ERROR_OK;
+          }
+          else
+          {
+            // Single digit (longer numbers are binary literals)
+            *queueptr++ = op - '0';
+          }
           lastop = 0;
         }
         else if (op >= 'A' && op <= 'Z')
@@ -1437,19 +2676,28 @@ static VAR_TYPE expression(unsigned char mode)
           variable_frame* frame;
           unsigned char* ptr = get_variable_frame(op, &frame);
           
-          if (frame->type == VAR_DIM_BYTE)
+          if (frame->type != VAR_INT)
           {
             if (stackptr + 1 >= stackend)
             {
               goto expr_oom;
             }
 #if defined(FEATURE_LAZY_INDEX) && FEATURE_LAZY_INDEX
-            if (*txtpos >= '0' && *txtpos <= '9')
+            if ((*txtpos >= '0' && *txtpos <= '9') || IS_LITERAL(*txtpos))
             {
               unsigned char* otxtpos = txtpos;
-              VAR_TYPE index = parse_int(255, 10);
-              error_num = ERROR_OK;
-              if (index < 0 || index >= frame->header.frame_size - sizeof(variable_frame))
+              VAR_TYPE index;
+              if (IS_LITERAL(*txtpos))
+              {
+                index = literal_value(*txtpos, txtpos + 1);
+                txtpos += 1 + LITERAL_SIZE(*txtpos);
+              }
+              else
+              {
+                index = parse_int(255, 10);
+                error_num = ERROR_OK;
+              }
+              if (index < 0 || index >= VAR_DIM_SIZE(frame))
               {
                 txtpos = otxtpos;
                 error_num = ERROR_EXPRESSION;
@@ -1490,6 +2738,18 @@ static VAR_TYPE expression(unsigned char mode)
         lastop = 0;
         break;
 
+      case LIT_INT8:
+      case LIT_INT16:
+      case LIT_INT32:
+        if (queueptr == queueend)
+        {
+          goto expr_oom;
+        }
+        *queueptr++ = literal_value(op, txtpos);
+        txtpos += LITERAL_SIZE(op);
+        lastop = 0;
+        break;
+
       case FUNC_HEX:
         if (queueptr == queueend)
         {
@@ -1556,9 +2816,14 @@ static VAR_TYPE expression(unsigned char mode)
         else if (ch == '"' && txtpos[2] == '"') {
           if (txtpos[1] >= 'A' && txtpos[1] <= 'Z')
           {
-            // figure out the length of the named file
-            // tbd
-            // goto expr_error;
+            // figure out the length of the named file, in records
+            if (queueptr == queueend)
+            {
+              goto expr_oom;
+            }
+            *queueptr++ = file_length(txtpos[1]);
+            txtpos += 3;
+            if (*txtpos++ != ')') goto expr_error;
           }
 #if ENABLE_SNV      
           else if (txtpos[1] >= '0' && txtpos[1] <= '9')
@@ -1592,11 +2857,11 @@ static VAR_TYPE expression(unsigned char mode)
           variable_frame* frame;
           txtpos += 2;
           get_variable_frame(ch, &frame);
-          if (frame->type != VAR_DIM_BYTE)
+          if (frame->type == VAR_INT)
           {
             goto expr_error;
           }
-          *queueptr++ = frame->header.frame_size - sizeof(variable_frame);
+          *queueptr++ = VAR_DIM_SIZE(frame);
         }
         lastop = 0;
         break;
@@ -1736,15 +3001,16 @@ static VAR_TYPE expression(unsigned char mode)
                   if (files[top].filename >= 'A')
 #endif
                 {
-                  unsigned char* special = flashstore_findspecial(FS_MAKE_FILE_SPECIAL(files[top].filename, files[top].record));
+                  file_sync(files[top].filename);
+                  unsigned char* special = file_item(&files[top]);
                   if (special)
                   {
-                    // check if poffset is at the end, so we look ahead into next record
+                    // check if poffset is at the end, so we look ahead into the next part or record
                     unsigned char len = special[FLASHSPECIAL_DATA_LEN];
-                    if (files[top].poffset == len)
+                    if (files[top].poffset == len && !file_nextpart(&files[top], special, files[top].part + 1))
                     {
                       unsigned short record = (files[top].record + 1) % files[top].modulo;
-                      special = flashstore_findspecial(FS_MAKE_FILE_SPECIAL(files[top].filename, record));
+                      special = file_has(&files[top], record) ? special : NULL;
                     }
                   }
                   queueptr[-1] = special ? 0 : 1;
@@ -1821,7 +3087,7 @@ static VAR_TYPE expression(unsigned char mode)
                 {
                   variable_frame* frame;
                   unsigned char* ptr = get_variable_frame(op, &frame);
-                  if (frame->type != VAR_DIM_BYTE || top < 0 || top >= frame->header.frame_size - sizeof(variable_frame))
+                  if (frame->type == VAR_INT || top < 0 || top >= VAR_DIM_SIZE(frame))
                   {
                     goto expr_error;
                   }
@@ -2008,6 +3274,24 @@ void interpreter_loop(void)
 //
 unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
 {
+#if FEATURE_COMPUTED_GOTO
+  // Statement dispatch, one label per token
+  static const void* const statement_table[256] =
+  {
+    [0 ... 255] = &&statement_default,
+#define STATEMENT(T, L) [T] = &&L,
+#include "statement_table.h"
+#undef STATEMENT
+  };
+#endif
+#if FEATURE_SLICE_STATS
+  const unsigned long slice_start = OS_get_millis();
+  unsigned char source = INTERPRETER_SOURCE_GET(canreturn);
+  if (source == SLICE_RESUME)
+  {
+    source = slice_yielded;
+  }
+#endif
 #if defined ENABLE_YIELD && ENABLE_YIELD 
   if (canreturn & INTERPRETER_CAN_YIELD)
   {
@@ -2015,6 +3299,7 @@ unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
   }
 #endif  
   error_num = ERROR_OK;
+  interpreter_running++;
 
   if (gofrom)
   {
@@ -2028,6 +3313,13 @@ unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
       f->header.frame_type = FRAME_EVENT_FLAG;
       f->header.frame_size = sizeof(event_frame);
     }
+#if FEATURE_COMPILE
+    // Compile the program if it wasn't started with RUN (e.g. AUTORUN)
+    if (!bytecode)
+    {
+      bytecode_build();
+    }
+#endif
     lineptr = findlineptr();
     txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
     if (lineptr >= program_end)
@@ -2045,15 +3337,13 @@ unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
 #endif
 
   txtpos = heap + sizeof(LINENUM);
-  tokenize();
 
   {
     unsigned char linelen;
 
     // Move it to the end of program_memory
     // Find the end of the freshly entered line
-    for(linelen = 0; txtpos[linelen++] != NL;)
-      ;
+    linelen = tokenize() + 1 - txtpos;
     OS_rmemcpy(sp - linelen, txtpos, linelen);
     txtpos = sp - linelen;
 
@@ -2094,12 +3384,13 @@ unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
       if (!newend)
       {
         // No space - attempt to compact flash
-        flashstore_compact(linelen, (unsigned char*)program_start, sp);
+        flashstore_compact(linelen, (unsigned char*)program_start, txtpos);
         newend = flashstore_addline(txtpos);
         if (!newend)
         {
           // Still no space
           SEMAPHORE_FLASH_SIGNAL();
+          interpreter_running--;
           return IX_OUTOFMEMORY;
         }
       }
@@ -2112,9 +3403,17 @@ unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
 
   
 prompt:
+#if FEATURE_PROFILE
+  // Don't charge the time until the interpreter runs again
+  profile_charge(OS_get_millis());
+#endif
+#if FEATURE_SLICE_STATS
+  slice_record(source, OS_get_millis() - slice_start);
+#endif
 #if ENABLE_BLE_CONSOLE  
   OS_prompt_buffer(heap + sizeof(LINENUM), sp);
 #endif  
+  interpreter_running--;
   return IX_PROMPT;
 
 // -- Commands ---------------------------------------------------------------
@@ -2137,6 +3436,7 @@ direct:
   
 run_next_statement:
   txtpos = *++lineptr + sizeof(LINENUM) + sizeof(char);
+run_line:
   if (lineptr >= program_end) // Out of lines to run
   {
     goto print_error_or_ok;
@@ -2149,142 +3449,95 @@ run_next_statement:
     if ( (OS_get_millis() - yield_time) >= timeSlice) 
     {
       unsigned short line = *(LINENUM*)lineptr[0];
+#if FEATURE_SLICE_STATS
+      slice_yielded = source;
+#endif
       OS_yield(line);
       goto prompt;
     }
   }
 #endif  
   interperate:
-  switch (*txtpos++)
+  OS_STAT_INC(statements);
+#if FEATURE_PROFILE
+  if (profile_on && lineptr < program_end)
   {
-    default:
-      if (*--txtpos < 0x80)
-      {
-        goto assignment;
-      }
-      break;
-    case KW_CONSTANT:
-      GOTO_QWHAT;
-#if ENABLE_BLE_CONSOLE      
-    case KW_LIST:
-      goto list;
-#endif
-    case KW_MEM:
-      goto mem;
-    case KW_NEW:
-      if (*txtpos != NL)
-      {
-        GOTO_QWHAT;
-      }
-      clean_memory();
-      program_end = flashstore_deleteall();
-      heap = (unsigned char*)program_end;
-      goto print_error_or_ok;
-    case KW_RUN:
-      clean_memory();
-      lineptr = program_start;
-      if (lineptr >= program_end)
-      {
-        goto print_error_or_ok;
-      }
-      txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
-      goto interperate;
-    case KW_NEXT:
-      goto next;
-    case KW_IF:
-    case KW_ELIF:
-      goto cmd_elif;
-    case KW_ELSE:
-      goto cmd_else;
-    case KW_GOTO:
-      linenum = expression(EXPR_NORMAL);
-      if (error_num || *txtpos != NL)
-      {
-        GOTO_QWHAT;
-      }
-      lineptr = findlineptr();
-      if (lineptr >= program_end)
-      {
-        goto print_error_or_ok;
-      }
-      txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
-      goto interperate;
-    case KW_GOSUB:
-      goto cmd_gosub;
-    case KW_RETURN:
-      goto gosub_return;
-    case KW_REM:
-    case KW_SLASHSLASH:
-      goto run_next_statement;
-    case KW_FOR:
-      goto forloop;
-    case KW_PRINT:
-      goto print;
-    case KW_REBOOT:
-      goto cmd_reboot;
-    case KW_END:
-      goto run_next_statement;
-    case KW_DIM:
-      goto cmd_dim;
-    case KW_TIMER:
-      goto cmd_timer;
-    case KW_DELAY:
-      goto cmd_delay;
-    case KW_AUTORUN:
-      goto cmd_autorun;
-#ifdef ENABLE_PORT0
-    case KW_PIN_P0:
+    profile_statement();
+  }
 #endif
-#ifdef ENABLE_PORT1
-    case KW_PIN_P1:
+#if FEATURE_COMPUTED_GOTO
+  goto *statement_table[*txtpos++];
+#else
+  switch (*txtpos++)
+  {
+#define STATEMENT(T, L) case T: goto L;
+#include "statement_table.h"
+#undef STATEMENT
+  }
 #endif
-#ifdef ENABLE_PORT2
-    case KW_PIN_P2:
+statement_default:
+  if (*--txtpos < 0x80)
+  {
+    goto assignment;
+  }
+  GOTO_QWHAT;
+
+cmd_new:
+  if (*txtpos != NL)
+  {
+    GOTO_QWHAT;
+  }
+  clean_memory();
+  program_end = flashstore_deleteall();
+  heap = (unsigned char*)program_end;
+  goto print_error_or_ok;
+
+cmd_run:
+  clean_memory();
+  SEMAPHORE_FLASH_WAIT();
+  flashstore_checkpoint();
+  SEMAPHORE_FLASH_SIGNAL();
+#if FEATURE_SLICE_STATS
+  OS_memset(slices, 0, sizeof(slices));
 #endif
-      txtpos--;
-      goto assignpin;
-    case KW_GATT:
-      goto ble_gatt;
-    case KW_ADVERT:
-      ble_isadvert = 1;
-      goto ble_advert;
-    case KW_SCAN:
-      ble_isadvert = 0;
-      goto ble_scan;
-    case KW_BTPOKE:
-      goto cmd_btpoke;
-    case KW_PINMODE:
-      goto cmd_pinmode;
-    case KW_INTERRUPT:
-      goto cmd_interrupt;
-    case KW_SERIAL:
-      goto cmd_serial;
-#if !defined(ENABLE_SPI) || ENABLE_SPI      
-    case KW_SPI:
-      goto cmd_spi;
-#endif      
-    case KW_ANALOG:
-      goto cmd_analog;
-    case KW_CONFIG:
-      goto cmd_config;
-#if !defined(ENABLE_WIRE) || ENABLE_WIRE      
-    case KW_WIRE:
-      goto cmd_wire;
-#endif      
-#if HAL_I2C     
-    case KW_I2C:
-      goto cmd_i2c;
+  lineptr = program_start;
+  if (lineptr >= program_end)
+  {
+    goto print_error_or_ok;
+  }
+#if FEATURE_COMPILE
+  bytecode_build();
 #endif
-    case KW_OPEN:
-      goto cmd_open;
-    case KW_CLOSE:
-      goto cmd_close;
-    case KW_READ:
-      goto cmd_read;
-    case KW_WRITE:
-      goto cmd_write;
+  txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
+  goto interperate;
+
+cmd_goto:
+  linenum = expression(EXPR_NORMAL);
+  if (error_num || *txtpos != NL)
+  {
+    GOTO_QWHAT;
   }
-  GOTO_QWHAT;
+  lineptr = findlineptr();
+  if (lineptr >= program_end)
+  {
+    goto print_error_or_ok;
+  }
+  txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
+  goto interperate;
+
+#if defined(ENABLE_PORT0) || defined(ENABLE_PORT1) || defined(ENABLE_PORT2)
+cmd_pin:
+  txtpos--;
+  goto assignpin;
+#endif
+
+cmd_advert:
+  ble_isadvert = 1;
+  goto ble_advert;
+
+cmd_scan:
+  ble_isadvert = 0;
+  goto ble_scan;
 
 // -- Errors -----------------------------------------------------------------
   
@@ -2366,78 +3619,34 @@ cmd_elif:
     }
     else
     {
-      unsigned char nest = 0;
-      for (;;)
+      lineptr = block_skip(lineptr);
+      if (lineptr >= program_end)
       {
-        txtpos = *++lineptr;
-        if (lineptr >= program_end)
-        {
-          printmsg(error_msgs[ERROR_OK]);
-          goto prompt;
-        }
-        switch (txtpos[sizeof(LINENUM) + sizeof(char)])
-        {
-          case KW_IF:
-            nest++;
-            break;
-          case KW_ELSE:
-            if (!nest)
-            {
-              txtpos += sizeof(LINENUM) + sizeof(char) + 1;
-              goto run_next_statement;
-            }
-            break;
-          case KW_ELIF:
-            if (!nest)
-            {
-              txtpos += sizeof(LINENUM) + sizeof(char);
-              goto interperate;
-            }
-            break;
-          case KW_END:
-            if (!nest)
-            {
-              txtpos += sizeof(LINENUM) + sizeof(char) + 1;
-              goto run_next_statement;
-            }
-            nest--;
-            break;
-          default:
-            break;
-        }
+        printmsg(error_msgs[ERROR_OK]);
+        goto prompt;
+      }
+      txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
+      if (*txtpos == KW_ELIF)
+      {
+        goto interperate;
       }
+      goto run_next_statement;
     }
  
 cmd_else:
   {
-    unsigned char nest = 0;
     ignore_blanks();
     if (*txtpos != NL)
     {
       GOTO_QWHAT;
     }
-    for (;;)
+    lineptr = block_skip(lineptr);
+    if (lineptr >= program_end)
     {
-      txtpos = *++lineptr;
-      if (lineptr >= program_end)
-      {
-        printmsg(error_msgs[ERROR_OK]);
-        goto prompt;
-      }
-      if (txtpos[sizeof(LINENUM) + sizeof(char)] == KW_IF)
-      {
-        nest++;
-      }
-      else if (txtpos[sizeof(LINENUM) + sizeof(char)] == KW_END)
-      {
-        if (!nest)
-        {
-          txtpos += sizeof(LINENUM) + sizeof(char) + 1;
-          goto run_next_statement;
-        }
-        nest--;
-      }
+      printmsg(error_msgs[ERROR_OK]);
+      goto prompt;
     }
+    goto run_next_statement;
   }
 
 forloop:
@@ -2509,7 +3718,7 @@ forloop:
     f->for_var = var;
     f->terminal = terminal;
     f->step = step;
-    f->line = lineptr;
+    f->line = lineptr + 1;
     goto run_next_statement;
   }
 
@@ -2542,6 +3751,22 @@ next:
   {
     GOTO_QWHAT;
   }
+  // Fast path: the innermost frame is the loop we're continuing, so there's
+  // no need to walk the stack
+  if (sp < variables_begin && ((frame_header*)sp)->frame_type == FRAME_FOR_FLAG && ((for_frame*)sp)->for_var == *txtpos)
+  {
+    for_frame *f = (for_frame *)sp;
+    VAR_TYPE v = VARIABLE_INT_GET(f->for_var) + f->step;
+    VARIABLE_INT_SET(f->for_var, v);
+    if ((f->step > 0 && v <= f->terminal) || (f->step < 0 && v >= f->terminal))
+    {
+      lineptr = f->line;
+      txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
+      goto run_line;
+    }
+    sp += f->header.frame_size;
+    goto run_next_statement;
+  }
 
 gosub_return:  
   switch (cleanup_stack())
@@ -2740,6 +3965,18 @@ mem:
   printmsg(memorymsg);
   printnum(0, sp - heap);
   printmsg(" bytes on heap free.");
+#if FLASHSTORE_LINECACHE_SIZE
+  printnum(0, flashstore_linecache_hits);
+  printmsg(" line cache hits.");
+  printnum(0, flashstore_linecache_misses);
+  printmsg(" line cache misses.");
+#endif
+#if FLASHSTORE_SPECIALDIR_SIZE
+  printnum(0, flashstore_specialdir_hits);
+  printmsg(" special directory hits.");
+  printnum(0, flashstore_specialdir_misses);
+  printmsg(" special directory misses.");
+#endif
 #if CHECK_MIN_MEMORY
   CHECK_MIN_MEMORY();
   printnum(0, minMemory);
@@ -2765,6 +4002,86 @@ mem:
 #endif  
   goto run_next_statement;
 
+#if FEATURE_PROFILE
+//
+// PROFILE ON|OFF|DUMP
+//  Count statements and milliseconds per program line. ON clears the counts (as does RUN),
+//  DUMP prints the hottest lines.
+//
+cmd_profile:
+  {
+    unsigned char op = *txtpos++;
+    if (op == KW_CONSTANT)
+    {
+      op = *txtpos++;
+    }
+    if (*txtpos != NL)
+    {
+      GOTO_QWHAT;
+    }
+    switch (op)
+    {
+      case CO_ON:
+        if (profile == (profile_frame*)1)
+        {
+          profile = NULL;
+        }
+        else if (profile)
+        {
+          OS_memset(profile + 1, 0, profile->header.frame_size - sizeof(profile_frame));
+        }
+        profile_line = PROFILE_NONE;
+        profile_on = 1;
+        break;
+      case CO_OFF:
+        profile_charge(OS_get_millis());
+        profile_on = 0;
+        break;
+      case PR_DUMP:
+        if (profile == (profile_frame*)1)
+        {
+          printmsg(profilenomemmsg);
+        }
+        else if (profile)
+        {
+          profile_charge(OS_get_millis());
+          profile_dump();
+        }
+        break;
+      default:
+        GOTO_QWHAT;
+    }
+  }
+  goto run_next_statement;
+#endif
+
+//
+// FSCK
+//  Check the flashstore and print how its pages are used.
+//
+cmd_fsck:
+  if (*txtpos != NL)
+  {
+    GOTO_QWHAT;
+  }
+  flashstore_fsck(heap, sp);
+  goto run_next_statement;
+
+#if FEATURE_SLICE_STATS
+//
+// SLICES
+//  Print how often each event source ran and by how much its runs overran the
+//  time slice. RUN clears the counts.
+//
+cmd_slices:
+  if (*txtpos != NL)
+  {
+    GOTO_QWHAT;
+  }
+  slice_dump();
+  goto run_next_statement;
+#endif
+
 //
 // REBOOT [UP]
 //  Reboot the device. If the UP option is present, reboot into upgrade mode.
@@ -2913,6 +4230,9 @@ cmd_autorun:
       autorun[2] = 7;
       *(unsigned long*)&autorun[3] = FLASHSPECIAL_AUTORUN;
       addspecial_with_compact(autorun);
+      SEMAPHORE_FLASH_WAIT();
+      flashstore_checkpoint();
+      SEMAPHORE_FLASH_SIGNAL();
     }
     else
     {
@@ -3677,18 +4997,29 @@ cmd_btpoke:
 
 //
 // OPEN <0-3>, READ|TRUNCATE|APPEND "<A-Z> | <0-9>"[, modulo[, record]]
+// OPEN <0-3>, TRUNCATE|APPEND "<A-Z>", DELTA[, TIME]
+// OPEN <0-3>, TRUNCATE|APPEND "<A-Z>", TIME[, modulo[, record]]
 //  Open a numbered file for read, write or append access.
 //  optional modulo paramter wraps read, write record number around
 //  in case the file name is a number between 0-9 access SNV
+//  DELTA packs small records as their differences to the record before
+//  TIME starts each record with the MILLIS it was written at, for SEEK to find
 cmd_open:
   {
     unsigned char hasOffset = FALSE;
+    unsigned char codec = FALSE;
+    unsigned char timed = FALSE;
     unsigned char id = expression(EXPR_COMMA);
     if (error_num || id >= FS_NR_FILE_HANDLES)
     {
       GOTO_QWHAT;
     }
     os_file_t* file = &files[id];
+    if (!file_close(file))
+    {
+      SET_ERR_LINE;
+      goto qoom;
+    }
 #if ENABLE_SNV    
     bool bSnv = txtpos[2] >= '0' && txtpos[2] <= '9';
 #else
@@ -3700,14 +5031,42 @@ cmd_open:
       file->filename = txtpos[2];
       file->record = 0;
       file->poffset = FLASHSPECIAL_DATA_OFFSET;
+      file->part = 0;
+      file->tlen = 0;
       file->modulo = FLASHSPECIAL_NR_FILE_RECORDS;
+      file->count = 0;
+      file->metanext = 0;
+#if FS_WRITE_BUFFER
+      file->bcount = 0;
+#endif
     }
     else
     {
       GOTO_QWHAT;
     }
     unsigned char kw = *txtpos;
-    if (txtpos[4] == ',')
+    if (!file_sync(file->filename))
+    {
+      SET_ERR_LINE;
+      goto qoom;
+    }
+    while (txtpos[4] == ',' && (txtpos[5] == FS_DELTA || txtpos[5] == FS_TIME))
+    {
+      if (kw == KW_READ || bSnv)
+      {
+        GOTO_QWHAT;
+      }
+      if (txtpos[5] == FS_DELTA)
+      {
+        codec = TRUE;
+      }
+      else
+      {
+        timed = TRUE;
+      }
+      txtpos += 2;
+    }
+    if (!codec && txtpos[4] == ',')
     {
       txtpos += 5;
       VAR_TYPE value = expression(EXPR_COMMA);
@@ -3730,20 +5089,52 @@ cmd_open:
     switch (kw)
     {
       case KW_READ: // Read
+      {
         file->action = 'R';
+        unsigned char* meta = flashstore_findspecial(FS_MAKE_META_SPECIAL(file->filename));
+        // Reading starts after a record's time
+        if (!bSnv && file_timed(file->filename, meta))
+        {
+          file->tlen = FS_TIME_LEN;
+          file->poffset += FS_TIME_LEN;
+        }
+#if FS_WRITE_BUFFER
+        // A packed file's records can be anywhere in its blocks
+        if (file_packed(meta) && !(file->cbuf = OS_malloc(FS_CODEC_BUF)))
+        {
+          SET_ERR_LINE;
+          goto qoom;
+        }
+#endif
         break;
+      }
       case FS_TRUNCATE: // Truncate
       {
         file->action = 'W';
         if (bSnv)
           break;
 //        DEBUG_P20_CLR;
-        for (unsigned long special = FS_MAKE_FILE_SPECIAL(file->filename, file->record); flashstore_deletespecial(special); special++)
+        unsigned char n;
+        for (unsigned short record = file->record; (n = file_run(file->filename, record, 1)); record += n)
         {
           // keep OSAL spinning
-          if (special % 16 == 0) osal_run_system();
+          if (record % 16 == 0) osal_run_system();
         }
+        for (unsigned short slot = (file->record + FS_TIME_STRIDE - 1) / FS_TIME_STRIDE; flashstore_deletespecial(FS_MAKE_TIME_SPECIAL(file->filename, slot)); slot++)
+          ;
+        file->tlen = timed ? FS_TIME_LEN : 0;
+        // The file now ends where writing starts, and CLOSE says so
+        file->count = file->record;
+        flashstore_deletespecial(FS_MAKE_META_SPECIAL(file->filename));
+        file->meta = NULL;
 //        DEBUG_P20_SET;
+#if FS_WRITE_BUFFER
+        file->wbuf = OS_malloc(FS_WRITE_BUFFER_ALLOC);
+        if (codec && file->wbuf)
+        {
+          file->cbuf = OS_malloc(FS_CODEC_BUF);
+        }
+#endif
         break;
       }
       case FS_APPEND: // Append
@@ -3753,15 +5144,69 @@ cmd_open:
         file->action = 'W';
         unsigned short record = file->record;
         file->record = 0;
-        for (unsigned long special = FS_MAKE_FILE_SPECIAL(file->filename, 0); flashstore_findspecial(special); special++, file->record++)
+        unsigned char* meta = flashstore_findspecial(FS_MAKE_META_SPECIAL(file->filename));
+        file_metaat(file, meta);
+        file->tlen = file_timed(file->filename, meta) ? FS_TIME_LEN : 0;
+        // A ring can't replace records packed in blocks, so a packed file is never one
+        if (file->modulo < FLASHSPECIAL_NR_FILE_RECORDS && file_packed(meta))
+        {
+          file->action = 0;
+          GOTO_QWHAT;
+        }
+#if FS_WRITE_BUFFER
+        // A packed file stays packed
+        file->wbuf = OS_malloc(FS_WRITE_BUFFER_ALLOC);
+        if ((codec || file_packed(meta)) && file->wbuf)
+        {
+          file->cbuf = OS_malloc(FS_CODEC_BUF);
+        }
+#endif
+        if (meta && *(unsigned short*)&meta[FS_META_MODULO] == file->modulo)
         {
-          if (hasOffset && (unsigned short) (special & 0xffff) >= record)
+          // Carry on where the metadata says the file ends, if its last record is there
+          unsigned short next = *(unsigned short*)&meta[FS_META_NEXT];
+          unsigned short count = *(unsigned short*)&meta[FS_META_COUNT];
+          if (!count || file_find(file, (next + (unsigned long)file->modulo - 1) % file->modulo))
           {
-            break;
+            file->count = count;
+            file->metanext = next;
+            if (!hasOffset)
+            {
+              file->record = next;
+            }
           }
-          // keep OSAL spinning
-          if (special % 16 == 0) osal_run_system();          
         }
+        // A ring file's head is only known from its metadata, other files may
+        // have records past it
+        if (hasOffset || !file->count || file->modulo == FLASHSPECIAL_NR_FILE_RECORDS)
+        {
+          for (unsigned char n; (n = file_run(file->filename, file->record, 0)); file->record += n)
+          {
+            if (hasOffset && file->record >= record)
+            {
+              break;
+            }
+            // keep OSAL spinning
+            if (file->record % 16 == 0) osal_run_system();          
+          }
+          if (file->record > file->count)
+          {
+            file->count = file->record;
+          }
+        }
+        // A file's records are timed or not from its first on
+        if (timed && !file->tlen)
+        {
+          if (file->count)
+          {
+            file_close(file);
+            GOTO_QWHAT;
+          }
+          file->tlen = FS_TIME_LEN;
+        }
+#if FS_WRITE_BUFFER
+        file->cblock = NULL;
+#endif
         break;
       }
       default:
@@ -3803,19 +5248,131 @@ cmd_close:
 #if HAL_I2C_SLAVE
     else if (*txtpos == KW_I2C)
     {
-      txtpos++;
-      OS_i2c_close(0);
+      txtpos++;
+      OS_i2c_close(0);
+    }
+#endif
+    else
+    {
+      unsigned char id = expression(EXPR_COMMA);
+      if (error_num || id >= FS_NR_FILE_HANDLES)
+      {
+        GOTO_QWHAT;
+      }
+      if (!file_close(&files[id]))
+      {
+        SET_ERR_LINE;
+        goto qoom;
+      }
+    }
+  }
+  goto run_next_statement;
+
+//
+// FLUSH #<0-3>
+//  Write the records the numbered file has buffered to flash now.
+cmd_flush:
+  {
+    if (*txtpos++ != '#')
+    {
+      GOTO_QWHAT;
+    }
+    unsigned char id = expression(EXPR_COMMA);
+    if (error_num || id >= FS_NR_FILE_HANDLES || files[id].action != 'W')
+    {
+      GOTO_QWHAT;
+    }
+    if (!file_flush(&files[id], FILE_FLUSH_COMPACT))
+    {
+      SET_ERR_LINE;
+      goto qoom;
+    }
+  }
+  goto run_next_statement;
+
+//
+// MAP #<0-3>, <variable>
+//  Make the variable a read only array of the record the numbered file is at,
+//  which follows the file as it moves on. Reading the array reads the flash.
+cmd_map:
+  {
+    if (*txtpos++ != '#')
+    {
+      GOTO_QWHAT;
+    }
+    unsigned char id = expression(EXPR_COMMA);
+    ignore_blanks();
+    const unsigned char name = *txtpos++;
+    if (error_num || id >= FS_NR_FILE_HANDLES || files[id].action != 'R' || files[id].filename < 'A' || name < 'A' || name > 'Z')
+    {
+      GOTO_QWHAT;
+    }
+    CHECK_SP_OOM(sizeof(map_frame), qoom);
+    map_frame* map = (map_frame*)sp;
+    map->frame.header.frame_type = FRAME_VARIABLE_FLAG;
+    map->frame.header.frame_size = sizeof(map_frame);
+    map->frame.type = VAR_DIM_MAP;
+    map->frame.name = name;
+    map->frame.ble = NULL;
+    map->file = &files[id];
+    map->filename = files[id].filename;
+    map->item = NULL;
+    VARIABLE_SAVE(&map->frame);
+  }
+  goto run_next_statement;
+
+//
+// NEXTREC #<0-3>
+//  Move the numbered file on to its next record, without reading the rest of
+//  this one. A mapped array shows the next record, and EOF() says if there is one.
+cmd_nextrec:
+  {
+    if (*txtpos++ != '#')
+    {
+      GOTO_QWHAT;
+    }
+    unsigned char id = expression(EXPR_COMMA);
+    if (error_num || id >= FS_NR_FILE_HANDLES || files[id].action != 'R' || files[id].filename < 'A')
+    {
+      GOTO_QWHAT;
+    }
+    os_file_t* file = &files[id];
+    file_sync(file->filename);
+    if (!file_find(file, file->record))
+    {
+      SET_ERR_LINE;
+      goto qeof;
+    }
+    file->record = (file->record + 1) % file->modulo;
+    file->poffset = FLASHSPECIAL_DATA_OFFSET + file->tlen;
+    file->part = 0;
+  }
+  goto run_next_statement;
+
+//
+// SEEK #<0-3>, TIME <time>
+//  Move the numbered TIME file on to its first record written at or after the
+//  time, or to its end when there is none. The file's index is binary searched,
+//  so only a few records are looked at however long the file is.
+cmd_seek:
+  {
+    if (*txtpos++ != '#')
+    {
+      GOTO_QWHAT;
+    }
+    unsigned char id = expression(EXPR_COMMA);
+    ignore_blanks();
+    if (error_num || id >= FS_NR_FILE_HANDLES || files[id].action != 'R' || !files[id].tlen || *txtpos++ != FS_TIME)
+    {
+      GOTO_QWHAT;
     }
-#endif
-    else
+    VAR_TYPE time = expression(EXPR_NORMAL);
+    if (error_num)
     {
-      unsigned char id = expression(EXPR_COMMA);
-      if (error_num || id >= FS_NR_FILE_HANDLES)
-      {
-        GOTO_QWHAT;
-      }
-      files[id].action = 0;
+      GOTO_QWHAT;
     }
+    file_sync(files[id].filename);
+    file_seek(&files[id], time);
   }
   goto run_next_statement;
 
@@ -3949,7 +5506,8 @@ cmd_read:
       if (file->filename >= 'A')
 #endif        
       {
-        unsigned char* special = flashstore_findspecial(FS_MAKE_FILE_SPECIAL(file->filename, file->record));
+        file_sync(file->filename);
+        unsigned char* special = file_item(file);
         if (!special)
         {
           SET_ERR_LINE;
@@ -3975,14 +5533,12 @@ cmd_read:
           {
             if (file->poffset == len)
             {
-              file->record = (file->record + 1) % file->modulo;
-              special = flashstore_findspecial(FS_MAKE_FILE_SPECIAL(file->filename, file->record));
+              special = file_next(file, special);
               if (!special)
               {
                 SET_ERR_LINE;
                 goto qeof;
               }
-              file->poffset = FLASHSPECIAL_DATA_OFFSET;
               len = special[FLASHSPECIAL_DATA_LEN];
             }
             if (vframe->type == VAR_DIM_BYTE)
@@ -4006,14 +5562,12 @@ cmd_read:
             {
               if (file->poffset == len)
               {
-                file->record = (file->record + 1) % file->modulo;
-                special = flashstore_findspecial(FS_MAKE_FILE_SPECIAL(file->filename, file->record));
+                special = file_next(file, special);
                 if (!special)
                 {
                   SET_ERR_LINE;
                   goto qeof;
                 }
-                file->poffset = FLASHSPECIAL_DATA_OFFSET;
                 len = special[FLASHSPECIAL_DATA_LEN];
               }
               unsigned char blen = (alen < len - file->poffset ? alen : len - file->poffset);
@@ -4032,16 +5586,13 @@ cmd_read:
 #if ENABLE_SNV
       else
       {
-        // we read from SNV
-        unsigned char* item = heap;
+        // we read from SNV, straight into the variables
         osalSnvId_t id = SNV_MAKE_ID(file->filename);
         unsigned char len = get_snv_length(id);
-        CHECK_HEAP_OOM(len, qhoom3);
-        if (osal_snv_read( id, len, item) != SUCCESS)
+        if (!len)
         {
-           heap = item;
-           SET_ERR_LINE;
-           goto qeof;
+          SET_ERR_LINE;
+          goto qeof;
         }
         file->poffset = 1;
         txtpos--;
@@ -4058,7 +5609,6 @@ cmd_read:
           }
           if (file->poffset >= len)
           {
-            heap = item;
             SET_ERR_LINE;
             goto qeof;
           }
@@ -4066,7 +5616,12 @@ cmd_read:
           unsigned char* ptr = parse_variable_address(&vframe);
           if (ptr)
           {
-            unsigned char v = item[file->poffset++];
+            unsigned char v;
+            if (osal_snv_read_at(id, file->poffset++, 1, &v) != SUCCESS)
+            {
+              SET_ERR_LINE;
+              goto qeof;
+            }
             if (vframe->type == VAR_DIM_BYTE)
             {
               *ptr = v;
@@ -4085,14 +5640,12 @@ cmd_read:
             ptr = (unsigned char*)vframe + sizeof(variable_frame);
             while (alen)
             {
-              if (file->poffset >= len)
+              unsigned char blen = (alen < len - file->poffset ? alen : len - file->poffset);
+              if (file->poffset >= len || osal_snv_read_at(id, file->poffset, blen, ptr) != SUCCESS)
               {
-                heap = item;
                 SET_ERR_LINE;
                 goto qeof;
               }
-              unsigned char blen = (alen < len - file->poffset ? alen : len - file->poffset);
-              OS_memcpy(ptr, item + file->poffset, blen);
               ptr += blen;
               alen -= blen;
               file->poffset += blen;
@@ -4103,11 +5656,7 @@ cmd_read:
             GOTO_QWHAT;
           }
         }  // for(;;)
-      heap = item;
       goto run_next_statement;
-qhoom3:
-      heap = item;
-      goto qoom;
     //------------------------------    
       }
 #endif  //ENABLE_SNV
@@ -4153,11 +5702,11 @@ cmd_write:
           txtpos++;
         }
         variable_frame* vframe = NULL;
-        unsigned char* ptr = parse_variable_address(&vframe);
+        unsigned char* ptr = parse_variable_view(&vframe);
         if (ptr)
         {
           unsigned char send_byte;
-          if (vframe->type == VAR_DIM_BYTE)
+          if (vframe->type != VAR_INT)
           {
             send_byte = *ptr;
 //            OS_serial_write(port, *ptr) == 0);
@@ -4179,8 +5728,8 @@ cmd_write:
           if (error_num == ERROR_EXPRESSION)
             error_num = ERROR_OK; // clear parsing error due to missing index braces
           unsigned char alen;
-          ptr = (unsigned char*)vframe + sizeof(variable_frame);
-          for (alen = vframe->header.frame_size - sizeof(variable_frame); alen; alen--)
+          ptr = VAR_DIM_DATA(vframe);
+          for (alen = VAR_DIM_SIZE(vframe); alen; alen--)
           {
             for ( ; OS_serial_write(port, *ptr) == 0 ; )
             {
@@ -4235,17 +5784,19 @@ cmd_write:
           SET_ERR_LINE;
           goto qtoobig;
         }
-        unsigned long special = FS_MAKE_FILE_SPECIAL(files[id].filename, files[id].record++);
-        if (files[id].modulo < FLASHSPECIAL_NR_FILE_RECORDS)
-        {
-          files[id].record %= files[id].modulo;
-          flashstore_deletespecial(special);
-        }
+        unsigned long special = FS_MAKE_FILE_SPECIAL(files[id].filename, files[id].record);
         unsigned char* item = heap;
         unsigned char* iptr = item + FLASHSPECIAL_DATA_OFFSET;
         unsigned char ilen = FLASHSPECIAL_DATA_OFFSET;
         CHECK_HEAP_OOM(ilen, qhoom);
         *(unsigned long*)&item[FLASHSPECIAL_ITEM_ID] = special;
+        unsigned long time = OS_get_millis();
+        if (files[id].tlen)
+        {
+          CHECK_HEAP_OOM(FS_TIME_LEN, qhoom);
+          OS_memcpy(iptr, &time, FS_TIME_LEN);
+          iptr = heap;
+        }
 
         txtpos--;
         for (;;)
@@ -4261,10 +5812,10 @@ cmd_write:
             GOTO_QWHAT;
           }
           variable_frame* vframe = NULL;
-          unsigned char* ptr = parse_variable_address(&vframe);
+          unsigned char* ptr = parse_variable_view(&vframe);
           if (ptr)
           {
-            if (vframe->type == VAR_DIM_BYTE)
+            if (vframe->type != VAR_INT)
             {
               CHECK_HEAP_OOM(1, qhoom);
               *iptr = *ptr;
@@ -4280,9 +5831,9 @@ cmd_write:
             // No address, but we have a vframe - this is a full array
             if (error_num == ERROR_EXPRESSION)
               error_num = ERROR_OK; // clear parsing error due to missing index braces
-            unsigned char alen = vframe->header.frame_size - sizeof(variable_frame);
+            unsigned char alen = VAR_DIM_SIZE(vframe);
             CHECK_HEAP_OOM(alen, qhoom);
-            OS_memcpy(iptr, ((unsigned char*)vframe) + sizeof(variable_frame), alen);
+            OS_memcpy(iptr, VAR_DIM_DATA(vframe), alen);
           }
           else
           {
@@ -4299,7 +5850,7 @@ cmd_write:
               txtpos--;
             }
           }
-          if (iptr - item > 0xFC)
+          if (iptr - item > FLASHSPECIAL_DATA_OFFSET + FS_RECORD_MAX)
           {
             heap = item;
             SET_ERR_LINE;
@@ -4308,7 +5859,7 @@ cmd_write:
           iptr = heap;
         }
         item[FLASHSPECIAL_DATA_LEN] = iptr - item;
-        if (!addspecial_with_compact(item))
+        if (!file_index(&files[id], time) || !(iptr - item > FS_CHAIN_ITEMLEN ? file_chain(&files[id], item, iptr - item) : file_write(&files[id], item)))
         {
           SET_ERR_LINE;
           goto qhoom;
@@ -4341,11 +5892,11 @@ qhoom:
             GOTO_QWHAT;
           }
           variable_frame* vframe = NULL;
-          unsigned char* ptr = parse_variable_address(&vframe);
+          unsigned char* ptr = parse_variable_view(&vframe);
           if (ptr)
           {
             CHECK_HEAP_OOM(1, qhoom2);
-            if (vframe->type == VAR_DIM_BYTE)
+            if (vframe->type != VAR_INT)
             {
               *iptr = *ptr;
             }
@@ -4359,9 +5910,9 @@ qhoom:
             // No address, but we have a vframe - this is a full array
             if (error_num == ERROR_EXPRESSION)
               error_num = ERROR_OK; // clear parsing error due to missing index braces
-            unsigned char alen = vframe->header.frame_size - sizeof(variable_frame);
+            unsigned char alen = VAR_DIM_SIZE(vframe);
             CHECK_HEAP_OOM(alen, qhoom2);
-            OS_memcpy(iptr, ((unsigned char*)vframe) + sizeof(variable_frame), alen);
+            OS_memcpy(iptr, VAR_DIM_DATA(vframe), alen);
           }
           else
           {
@@ -4387,7 +5938,13 @@ qhoom:
           iptr = heap;
         }
         item[0] = iptr - item;  // save length 
-        if (osal_snv_write(SNV_MAKE_ID(files[id].filename), item[0], item) != SUCCESS)
+        unsigned char snvid = SNV_MAKE_ID(files[id].filename);
+#if OAD_KEEP_NV_PAGES
+        // Same length: update the data in place, the length byte is unchanged
+        if ((get_snv_length(snvid) == item[0] ? osal_snv_update(snvid, 1, item[0] - 1, item + 1) : osal_snv_write(snvid, item[0], item)) != SUCCESS)
+#else
+        if (osal_snv_write(snvid, item[0], item) != SUCCESS)
+#endif
         {
           SET_ERR_LINE;
           goto qhoom2;
@@ -4788,6 +6345,10 @@ cmd_i2c:
       }
       txtpos++;
       rdata = get_variable_frame(i, &vframe);
+      if (vframe->type == VAR_DIM_MAP)
+      {
+        GOTO_QWHAT;
+      }
       if (vframe->type == VAR_DIM_BYTE)
       {
         len = vframe->header.frame_size - sizeof(variable_frame);
@@ -4942,6 +6503,11 @@ i2c_end:
       }
       txtpos++;
       rdata = get_variable_frame(i, &vframe);
+      if (vframe->type == VAR_DIM_MAP)
+      {
+        heap = saved_heap;
+        GOTO_QWHAT;
+      }
       if (vframe->type == VAR_DIM_BYTE)
       {
         len = vframe->header.frame_size - sizeof(variable_frame);
@@ -5200,7 +6766,7 @@ static unsigned char cleanup_stack(void)
             if ((f->step > 0 && v <= f->terminal) || (f->step < 0 && v >= f->terminal))
             {
               // We have to loop so don't pop the stack
-              lineptr = f->line;
+              lineptr = f->line - 1;
             }
             else
             {
@@ -5595,6 +7161,10 @@ static void pin_wire_parse(void)
         {
           variable_frame* vframe;
           unsigned char* vptr = get_variable_frame(v, &vframe);
+          if (vframe->type == VAR_DIM_MAP)
+          {
+            goto wire_error;
+          }
           
           const unsigned char size = (vframe->type == VAR_DIM_BYTE ? sizeof(unsigned char) : sizeof(VAR_TYPE));
           if (pinParseReadAddr != vptr)
@@ -5980,55 +7550,914 @@ static void pin_wire(unsigned char* ptr, unsigned char* end)
 #ifdef SIMULATE_PINS
           ADCCON1 = 0x80;
 #endif
-          while ((ADCCON1 & 0x80) == 0)
-            ;
-          count = ADCL;
-          count |= ADCH << 8;
-          count = ((short)count) >> (8 - (analogResolution >> 3));
-          if (dstep == sizeof(unsigned char))
-          {
-            *dptr = count;
-          }
-          else
-          {
-            *(short*)dptr = count;
-          }
-          dptr += dstep;
-          break;
+          while ((ADCCON1 & 0x80) == 0)
+            ;
+          count = ADCL;
+          count |= ADCH << 8;
+          count = ((short)count) >> (8 - (analogResolution >> 3));
+          if (dstep == sizeof(unsigned char))
+          {
+            *dptr = count;
+          }
+          else
+          {
+            *(short*)dptr = count;
+          }
+          dptr += dstep;
+          break;
+        }
+        case WIRE_CASE(WIRE_INPUT_SET):
+          dptr = *(unsigned char**)ptr;
+          ptr += sizeof(unsigned char*);
+          dstep = *ptr++;
+          break;
+        default:
+          goto wire_error;
+      }
+    }
+  }
+  return;
+wire_error:
+  if (!error_num)
+  {
+    error_num = ERROR_GENERAL;
+  }
+  return;
+}
+
+static unsigned char addspecial_with_compact(unsigned char* item)
+{
+  *(unsigned short*)item = FLASHID_SPECIAL;
+  return addspecials_with_compact(item, item[sizeof(unsigned short)], 1) != NULL;
+}
+
+//
+// Write special items together, compacting the flash to make room for them
+// when compact is set (that needs the free memory). When no page has room for
+// them all even so, they go item by item into the ends of pages. Returns where
+// the last item went, or NULL.
+//
+static unsigned char* addspecials_with_compact(unsigned char* items, unsigned char len, unsigned char compact)
+{
+  unsigned char* ret;
+  len = FLASHSTORE_PADDEDSIZE(len);
+  SEMAPHORE_FLASH_WAIT();
+  ret = flashstore_addspecials(items, len);
+  if (!ret && compact)
+  {
+    // Compacting can move the running line, so keep our place by its offset
+    unsigned char offset = lineptr < program_end ? txtpos - *lineptr : 0;
+    flashstore_compact(len, heap, sp);
+    if (lineptr < program_end)
+    {
+      txtpos = *lineptr + offset;
+    }
+    ret = flashstore_addspecials(items, len);
+  }
+  if (ret)
+  {
+    // Point at the last item
+    for (unsigned char pos = 0; pos + FLASHSTORE_PADDEDSIZE(items[pos + sizeof(unsigned short)]) < len; pos += FLASHSTORE_PADDEDSIZE(items[pos + sizeof(unsigned short)]))
+    {
+      ret += FLASHSTORE_PADDEDSIZE(items[pos + sizeof(unsigned short)]);
+    }
+  }
+  else
+  {
+    for (unsigned char pos = 0; pos < len; pos += FLASHSTORE_PADDEDSIZE(items[pos + sizeof(unsigned short)]))
+    {
+      ret = flashstore_addspecials(items + pos, FLASHSTORE_PADDEDSIZE(items[pos + sizeof(unsigned short)]));
+      if (!ret)
+      {
+        break;
+      }
+    }
+  }
+  SEMAPHORE_FLASH_SIGNAL();
+  return ret;
+}
+
+// Move on to the next record, counting the records the file holds
+static void file_advance(os_file_t* file)
+{
+  if (file->record >= file->count)
+  {
+    file->count = file->record + 1;
+  }
+  file->record++;
+  if (file->modulo < FLASHSPECIAL_NR_FILE_RECORDS)
+  {
+    file->record %= file->modulo;
+  }
+}
+
+//
+// Fill in a new metadata item for the file, which replaces the one before.
+// APPEND and LEN read it rather than looking for the end record by record.
+//
+static void file_meta(os_file_t* file, unsigned char* item)
+{
+  file_dropmeta(file);
+  *(unsigned short*)item = FLASHID_SPECIAL;
+  item[FLASHSPECIAL_DATA_LEN] = FS_META_LEN;
+  *(unsigned long*)&item[FLASHSPECIAL_ITEM_ID] = FS_MAKE_META_SPECIAL(file->filename);
+  *(unsigned short*)&item[FS_META_NEXT] = file->record;
+  *(unsigned short*)&item[FS_META_COUNT] = file->count;
+  *(unsigned short*)&item[FS_META_MODULO] = file->modulo;
+#if FS_WRITE_BUFFER
+  item[FS_META_CODEC] = file->cbuf != NULL;
+#else
+  item[FS_META_CODEC] = 0;
+#endif
+  item[FS_META_TIME] = file->tlen != 0;
+  file->metanext = file->record;
+}
+
+// Remember where the metadata went, so replacing it needn't look it up
+static unsigned char file_metaat(os_file_t* file, unsigned char* ptr)
+{
+  file->meta = ptr;
+  file->metastamp = flashstore_stamp();
+  return ptr != NULL;
+}
+
+static unsigned char file_writemeta(os_file_t* file, unsigned char compact)
+{
+  static unsigned char item[FLASHSTORE_PADDEDSIZE(FS_META_LEN)];
+  file_meta(file, item);
+  return file_metaat(file, addspecials_with_compact(item, FS_META_LEN, compact));
+}
+
+//
+// Delete the file's metadata. Invalidating it needs no room in the flash, and
+// a ring file's has to go as soon as the ring moves on from it.
+//
+static void file_dropmeta(os_file_t* file)
+{
+  if (file->meta)
+  {
+    flashstore_deletespecialat(FS_MAKE_META_SPECIAL(file->filename), file->meta, file->metastamp);
+    file->meta = NULL;
+  }
+}
+
+#if FS_WRITE_BUFFER
+//
+// Pack a DELTA file's record into the block in the write buffer, which is
+// written like any buffered records. cbuf keeps the record to take the
+// differences from.
+//
+static unsigned char file_pack(os_file_t* file, unsigned char* item)
+{
+  unsigned char len = item[FLASHSPECIAL_DATA_LEN] - FLASHSPECIAL_DATA_OFFSET;
+  if (file->bcount ? file->bcount == FS_CODEC_RUN || file->wlen + FS_CODEC_MAXLEN(len) > FS_WRITE_BUFFER : file->wlen != 0)
+  {
+    if (!file_flush(file, FILE_FLUSH_COMPACT | FILE_FLUSH_FULL))
+    {
+      return 0;
+    }
+  }
+  if (!file->bcount)
+  {
+    // A new block, named after its first record which is packed against zeros
+    OS_flashstore_flush_after(FS_WRITE_TIMEOUT);
+    *(unsigned short*)file->wbuf = FLASHID_SPECIAL;
+    *(unsigned long*)&file->wbuf[FLASHSPECIAL_ITEM_ID] = FS_MAKE_BLOCK_SPECIAL(file->filename, file->record);
+    file->wlen = FLASHSPECIAL_DATA_OFFSET;
+    file->cbuf[FLASHSPECIAL_DATA_LEN] = FLASHSPECIAL_DATA_OFFSET;
+  }
+  file->wlen = flashstore_pack(file->wbuf + file->wlen, file->cbuf + FLASHSPECIAL_DATA_OFFSET, file->cbuf[FLASHSPECIAL_DATA_LEN] - FLASHSPECIAL_DATA_OFFSET, item + FLASHSPECIAL_DATA_OFFSET, len) - file->wbuf;
+  file->wbuf[FLASHSPECIAL_DATA_LEN] = file->wlen;
+  OS_memcpy(file->cbuf, item, item[FLASHSPECIAL_DATA_LEN]);
+  file->bcount++;
+  file_advance(file);
+  return 1;
+}
+#endif
+
+//
+// Write a file record. Records are collected in the handle's write buffer,
+// which goes to flash in one write when it is full, when the file is closed or
+// flushed, when FS_WRITE_TIMEOUT has passed, and before the file is read.
+//
+static unsigned char file_write(os_file_t* file, unsigned char* item)
+{
+#if FS_WRITE_BUFFER
+  unsigned long id = *(unsigned long*)&item[FLASHSPECIAL_ITEM_ID];
+  unsigned char len = FLASHSTORE_PADDEDSIZE(item[FLASHSPECIAL_DATA_LEN]);
+  if (file->cbuf && FS_CODEC_FITS(item[FLASHSPECIAL_DATA_LEN] - FLASHSPECIAL_DATA_OFFSET))
+  {
+    return file_pack(file, item);
+  }
+  if (file->wbuf && len <= FS_WRITE_BUFFER)
+  {
+    // A small ring file can come round to a record which is still waiting
+    if (file->bcount || file->wlen + len > FS_WRITE_BUFFER || file_buffered(file, id))
+    {
+      if (!file_flush(file, FILE_FLUSH_COMPACT | FILE_FLUSH_FULL))
+      {
+        return 0;
+      }
+    }
+    if (!file->wlen)
+    {
+      OS_flashstore_flush_after(FS_WRITE_TIMEOUT);
+    }
+    *(unsigned short*)item = FLASHID_SPECIAL;
+    OS_memcpy(file->wbuf + file->wlen, item, len);
+    file->wlen += len;
+    file_advance(file);
+    return 1;
+  }
+  if (!file_flush(file, FILE_FLUSH_COMPACT | FILE_FLUSH_FULL))
+  {
+    return 0;
+  }
+#endif
+  if (file->modulo < FLASHSPECIAL_NR_FILE_RECORDS)
+  {
+    file_delete(file->filename, file->record);
+    file_dropmeta(file);
+  }
+  if (!addspecial_with_compact(item))
+  {
+    return 0;
+  }
+  file_advance(file);
+  return 1;
+}
+
+//
+// Write a record too long for one item, len bytes with its header, as a chain
+// of parts. Whatever was at the record before goes first, and the first part
+// goes last, so the record is only found once all of it is there. Each part's
+// header goes in front of its bytes for the write, over the part before.
+//
+static unsigned char file_chain(os_file_t* file, unsigned char* item, unsigned short len)
+{
+  unsigned char save[FLASHSPECIAL_DATA_OFFSET];
+  unsigned char parts = (len - FLASHSPECIAL_DATA_OFFSET - 1) / FS_CHAIN_DATA;
+#if FS_WRITE_BUFFER
+  if (!file_flush(file, FILE_FLUSH_COMPACT | FILE_FLUSH_FULL))
+  {
+    return 0;
+  }
+#endif
+  file_delete(file->filename, file->record);
+  if (file->modulo < FLASHSPECIAL_NR_FILE_RECORDS)
+  {
+    file_dropmeta(file);
+  }
+  for (unsigned char part = 1; part <= parts; part++)
+  {
+    unsigned char* ptr = item + part * FS_CHAIN_DATA;
+    OS_memcpy(save, ptr, FLASHSPECIAL_DATA_OFFSET);
+    ptr[FLASHSPECIAL_DATA_LEN] = part < parts ? FS_CHAIN_ITEMLEN : len - part * FS_CHAIN_DATA;
+    *(unsigned long*)&ptr[FLASHSPECIAL_ITEM_ID] = FS_MAKE_CHAIN_SPECIAL(file->filename, file->record, part);
+    unsigned char ok = addspecial_with_compact(ptr);
+    OS_memcpy(ptr, save, FLASHSPECIAL_DATA_OFFSET);
+    if (!ok)
+    {
+      return 0;
+    }
+  }
+  item[FLASHSPECIAL_DATA_LEN] = FS_CHAIN_ITEMLEN;
+  *(unsigned long*)&item[FLASHSPECIAL_ITEM_ID] = FS_MAKE_CHAIN_SPECIAL(file->filename, file->record, 0);
+  if (!addspecial_with_compact(item))
+  {
+    return 0;
+  }
+  file_advance(file);
+  return 1;
+}
+
+//
+// The number of records in the named file. Plain files are checked for records
+// past the metadata's count.
+//
+static unsigned short file_length(unsigned char filename)
+{
+  unsigned short count = 0;
+  unsigned short modulo = FLASHSPECIAL_NR_FILE_RECORDS;
+  file_sync(filename);
+  unsigned char* meta = flashstore_findspecial(FS_MAKE_META_SPECIAL(filename));
+  if (meta)
+  {
+    count = *(unsigned short*)&meta[FS_META_COUNT];
+    modulo = *(unsigned short*)&meta[FS_META_MODULO];
+  }
+  if (modulo == FLASHSPECIAL_NR_FILE_RECORDS)
+  {
+    for (unsigned char n; count < FLASHSPECIAL_NR_FILE_RECORDS && (n = file_run(filename, count, 0)); )
+    {
+      count += n;
+    }
+  }
+  return count;
+}
+
+//
+// The number of records in the item holding the file's record and those
+// packed after it, or 0 when there is none. The item is deleted when del is
+// set, with all the parts of a chained record.
+//
+static unsigned char file_run(unsigned char filename, unsigned short record, unsigned char del)
+{
+  if (del)
+  {
+    return file_delete(filename, record);
+  }
+  if (flashstore_findspecial(FS_MAKE_FILE_SPECIAL(filename, record)))
+  {
+    return 1;
+  }
+#if FS_WRITE_BUFFER
+  unsigned char* block = flashstore_findspecial(FS_MAKE_BLOCK_SPECIAL(filename, record));
+  if (block)
+  {
+    return flashstore_packcount(block);
+  }
+#endif
+  return flashstore_findspecial(FS_MAKE_CHAIN_SPECIAL(filename, record, 0)) != NULL;
+}
+
+//
+// Delete everything a record may be held in: its own item, a block starting
+// at it, and every part of a chained record, even one whose first part was
+// never written. Returns the number of records that went, as file_run.
+//
+static unsigned char file_delete(unsigned char filename, unsigned short record)
+{
+  unsigned char n = flashstore_deletespecial(FS_MAKE_FILE_SPECIAL(filename, record)) ? 1 : 0;
+#if FS_WRITE_BUFFER
+  unsigned long id = FS_MAKE_BLOCK_SPECIAL(filename, record);
+  unsigned char* block = flashstore_findspecial(id);
+  if (block)
+  {
+    unsigned char count = flashstore_packcount(block);
+    n = count > n ? count : n;
+    flashstore_deletespecial(id);
+  }
+#endif
+  for (unsigned char part = 0; ; part++)
+  {
+    if (flashstore_deletespecial(FS_MAKE_CHAIN_SPECIAL(filename, record, part)))
+    {
+      n = n ? n : 1;
+    }
+    else if (part)
+    {
+      break;
+    }
+  }
+  return n;
+}
+
+#if FS_WRITE_BUFFER
+// The block cbuf was unpacked from, looked up again when the flash has moved on
+static unsigned char* file_block(os_file_t* file)
+{
+  if (file->cblock && (file->cstamp != flashstore_stamp() || *(unsigned short*)file->cblock != FLASHID_SPECIAL))
+  {
+    file->cblock = flashstore_findspecial(FS_MAKE_BLOCK_SPECIAL(file->filename, file->cstart));
+    file->cstamp = flashstore_stamp();
+  }
+  return file->cblock;
+}
+
+// Unpack the block's next record into cbuf
+static unsigned char file_unpack(os_file_t* file, unsigned char* block)
+{
+  if (file->cpos >= block[FLASHSPECIAL_DATA_LEN])
+  {
+    return 0;
+  }
+  file->cbuf[FLASHSPECIAL_DATA_LEN] -= FLASHSPECIAL_DATA_OFFSET;
+  file->cpos = flashstore_unpack(block + file->cpos, file->cbuf + FLASHSPECIAL_DATA_OFFSET, &file->cbuf[FLASHSPECIAL_DATA_LEN]) - block;
+  file->cbuf[FLASHSPECIAL_DATA_LEN] += FLASHSPECIAL_DATA_OFFSET;
+  file->cnum++;
+  return 1;
+}
+#endif
+
+//
+// Find a file record, in an item of its own or packed in a block. An unpacked
+// record is returned in cbuf, which is laid out like its item would be. Reading
+// on through a block unpacks each record over the one before.
+//
+static unsigned char* file_find(os_file_t* file, unsigned short record)
+{
+#if FS_WRITE_BUFFER
+  unsigned char* block = file_block(file);
+  if (block)
+  {
+    if (record == file->cnum)
+    {
+      return file->cbuf;
+    }
+    if (record == (unsigned short)(file->cnum + 1) && file_unpack(file, block))
+    {
+      return file->cbuf;
+    }
+  }
+#endif
+  unsigned char* special = flashstore_findspecial(FS_MAKE_FILE_SPECIAL(file->filename, record));
+  if (!special)
+  {
+    special = flashstore_findspecial(FS_MAKE_CHAIN_SPECIAL(file->filename, record, 0));
+  }
+#if FS_WRITE_BUFFER
+  // A block starting at the record, or before it once the file is known to be packed
+  for (unsigned char back = 0; !special && back < (file->cbuf ? FS_CODEC_RUN : 1) && back <= record; back++)
+  {
+    block = flashstore_findspecial(FS_MAKE_BLOCK_SPECIAL(file->filename, record - back));
+    if (block)
+    {
+      if (!file->cbuf && !(file->cbuf = OS_malloc(FS_CODEC_BUF)))
+      {
+        return NULL;
+      }
+      file->cblock = block;
+      file->cstamp = flashstore_stamp();
+      file->cstart = record - back;
+      file->cnum = file->cstart - 1;
+      file->cpos = FLASHSPECIAL_DATA_OFFSET;
+      file->cbuf[FLASHSPECIAL_DATA_LEN] = FLASHSPECIAL_DATA_OFFSET;
+      do
+      {
+        if (!file_unpack(file, block))
+        {
+          file->cblock = NULL;
+          return NULL;
         }
-        case WIRE_CASE(WIRE_INPUT_SET):
-          dptr = *(unsigned char**)ptr;
-          ptr += sizeof(unsigned char*);
-          dstep = *ptr++;
-          break;
-        default:
-          goto wire_error;
+      } while (file->cnum != record);
+      return file->cbuf;
+    }
+  }
+#endif
+  return special;
+}
+
+// Whether the file has the record, without unpacking it
+static unsigned char file_has(os_file_t* file, unsigned short record)
+{
+#if FS_WRITE_BUFFER
+  unsigned char* block = file_block(file);
+  if (block && record == (unsigned short)(file->cnum + 1) && file->cpos < block[FLASHSPECIAL_DATA_LEN])
+  {
+    return 1;
+  }
+#endif
+  return file_run(file->filename, record, 0) != 0;
+}
+
+// The item of the record, or the part of it, the file is at
+static unsigned char* file_item(os_file_t* file)
+{
+  if (file->part)
+  {
+    return flashstore_findspecial(FS_MAKE_CHAIN_SPECIAL(file->filename, file->record, file->part));
+  }
+  return file_find(file, file->record);
+}
+
+// The part of a chained record after the item, when the item is a full part of one
+static unsigned char* file_nextpart(os_file_t* file, unsigned char* item, unsigned char part)
+{
+  if (item[FLASHSPECIAL_DATA_LEN] != FS_CHAIN_ITEMLEN || !FS_IS_CHAIN_SPECIAL(*(unsigned long*)&item[FLASHSPECIAL_ITEM_ID]))
+  {
+    return NULL;
+  }
+  return flashstore_findspecial(FS_MAKE_CHAIN_SPECIAL(file->filename, file->record, part));
+}
+
+// Read on from the end of the item, into the next part of its record or the next record
+static unsigned char* file_next(os_file_t* file, unsigned char* item)
+{
+  item = file_nextpart(file, item, file->part + 1);
+  if (item)
+  {
+    file->part++;
+  }
+  else
+  {
+    file->part = 0;
+    file->record = (file->record + 1) % file->modulo;
+    item = file_find(file, file->record);
+  }
+  file->poffset = FLASHSPECIAL_DATA_OFFSET + (file->part ? 0 : file->tlen);
+  return item;
+}
+
+// Whether the metadata is a DELTA file's
+static unsigned char file_packed(unsigned char* meta)
+{
+  return meta && meta[FLASHSPECIAL_DATA_LEN] > FS_META_CODEC && meta[FS_META_CODEC];
+}
+
+// Whether the file is a TIME file, which its index's first slot tells when the metadata is gone
+static unsigned char file_timed(unsigned char filename, unsigned char* meta)
+{
+  if (!meta)
+  {
+    return flashstore_findspecial(FS_MAKE_TIME_SPECIAL(filename, 0)) != NULL;
+  }
+  return meta[FLASHSPECIAL_DATA_LEN] > FS_META_TIME && meta[FS_META_TIME];
+}
+
+// The time at the front of a TIME file's record, or of its index slot
+static unsigned long file_time(unsigned char* item)
+{
+  unsigned long time = 0;
+  OS_memcpy(&time, item + FLASHSPECIAL_DATA_OFFSET, FS_TIME_LEN);
+  return time;
+}
+
+//
+// Write the index slot of a TIME file's record about to be written, when it is
+// the slot's first. The slot goes straight to flash, ahead of any buffered
+// records, and replaces the one a ring file had there the time round before.
+//
+static unsigned char file_index(os_file_t* file, unsigned long time)
+{
+  static unsigned char item[FLASHSTORE_PADDEDSIZE(FLASHSPECIAL_DATA_OFFSET + FS_TIME_LEN)];
+  if (!file->tlen || file->record % FS_TIME_STRIDE)
+  {
+    return 1;
+  }
+  unsigned long id = FS_MAKE_TIME_SPECIAL(file->filename, file->record / FS_TIME_STRIDE);
+  flashstore_deletespecial(id);
+  *(unsigned short*)item = FLASHID_SPECIAL;
+  item[FLASHSPECIAL_DATA_LEN] = FLASHSPECIAL_DATA_OFFSET + FS_TIME_LEN;
+  *(unsigned long*)&item[FLASHSPECIAL_ITEM_ID] = id;
+  OS_memcpy(item + FLASHSPECIAL_DATA_OFFSET, &time, FS_TIME_LEN);
+  return addspecial_with_compact(item);
+}
+
+// The time of an index slot, from its first record when the slot is missing
+static unsigned char file_slottime(os_file_t* file, unsigned short slot, unsigned long* time)
+{
+  unsigned char* item = flashstore_findspecial(FS_MAKE_TIME_SPECIAL(file->filename, slot));
+  if (!item)
+  {
+    item = file_find(file, slot * FS_TIME_STRIDE);
+  }
+  if (!item)
+  {
+    return 0;
+  }
+  *time = file_time(item);
+  return 1;
+}
+
+//
+// Move a TIME file to its first record written at or after the time. A binary
+// search of the index finds the last slot before the time, and the records
+// from that slot's first on are looked at until one isn't. The slots are taken
+// from the oldest record on, which in a full ring file is the one at its head.
+//
+static void file_seek(os_file_t* file, unsigned long time)
+{
+  unsigned char* meta = flashstore_findspecial(FS_MAKE_META_SPECIAL(file->filename));
+  unsigned short count = file_length(file->filename);
+  unsigned short first = 0;
+  if (meta && file->modulo < FLASHSPECIAL_NR_FILE_RECORDS && count == file->modulo)
+  {
+    first = *(unsigned short*)&meta[FS_META_NEXT] % file->modulo;
+  }
+  unsigned short slots = (count + FS_TIME_STRIDE - 1) / FS_TIME_STRIDE;
+  unsigned short oldest = (first + FS_TIME_STRIDE - 1) / FS_TIME_STRIDE;
+  unsigned short lo = 0;
+  unsigned short hi = slots;
+  while (lo < hi)
+  {
+    unsigned short mid = (lo + hi) / 2;
+    unsigned long at;
+    if (file_slottime(file, (oldest + mid) % slots, &at) && FS_TIME_BEFORE(at, time))
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  file->record = lo ? (oldest + lo - 1) % slots * FS_TIME_STRIDE : first;
+  for (unsigned char* item; (item = file_find(file, file->record)) && FS_TIME_BEFORE(file_time(item), time); )
+  {
+    file->record = (file->record + 1) % file->modulo;
+    if (file->record == first)
+    {
+      break;
+    }
+  }
+  file->part = 0;
+  file->poffset = FLASHSPECIAL_DATA_OFFSET + FS_TIME_LEN;
+}
+
+//
+// Write out the records a file has buffered. The file's metadata is brought up
+// to date too unless the buffer was just full and more records are coming: a
+// plain file's is safe to leave behind, as APPEND and LEN look past its end.
+//
+static unsigned char file_flush(os_file_t* file, unsigned char mode)
+{
+  if (file->action != 'W')
+  {
+    return 1;
+  }
+#if FS_WRITE_BUFFER
+  if (file->bcount)
+  {
+    // The block is done, and the next record starts another
+    file->bcount = 0;
+    while (file->wlen != FLASHSTORE_PADDEDSIZE(file->wlen))
+    {
+      file->wbuf[file->wlen++] = 0xFF;
+    }
+  }
+  unsigned char len = file->wlen;
+  if (len)
+  {
+    unsigned char* last;
+    if (file->modulo < FLASHSPECIAL_NR_FILE_RECORDS)
+    {
+      // Ring files replace the records they came round to. Those go first, as
+      // the new ones take their ids, and stay gone: the new ones are kept until
+      // they are written.
+      for (unsigned char pos = 0; pos < len; pos += FLASHSTORE_PADDEDSIZE(file->wbuf[pos + FLASHSPECIAL_DATA_LEN]))
+      {
+        // the record number is the low half of the item's id
+        file_delete(file->filename, (unsigned short)*(unsigned long*)&file->wbuf[pos + FLASHSPECIAL_ITEM_ID]);
       }
+      file_dropmeta(file);
+    }
+    if (mode & FILE_FLUSH_FULL)
+    {
+      last = addspecials_with_compact(file->wbuf, len, mode & FILE_FLUSH_COMPACT);
+    }
+    else
+    {
+      // The metadata goes last in the same write, so it agrees with the records
+      file_meta(file, file->wbuf + len);
+      last = addspecials_with_compact(file->wbuf, len + FS_META_LEN, mode & FILE_FLUSH_COMPACT);
+      file_metaat(file, last);
+    }
+    if (!last)
+    {
+      file_unbuffer(file);
+      return 0;
     }
+    file->wlen = 0;
+    return 1;
   }
-  return;
-wire_error:
-  if (!error_num)
+#endif
+  if ((mode & FILE_FLUSH_FULL) || (file->meta && file->metanext == file->record))
   {
-    error_num = ERROR_GENERAL;
+    return 1;
   }
-  return;
+  return file_writemeta(file, mode & FILE_FLUSH_COMPACT);
 }
 
-static unsigned char addspecial_with_compact(unsigned char* item)
+// Flush every handle writing the file, before it is read or reopened
+static unsigned char file_sync(unsigned char filename)
 {
-  unsigned char ret;
-  SEMAPHORE_FLASH_WAIT();
-  ret = flashstore_addspecial(item);
-  if (!ret )
+  unsigned char ret = 1;
+  for (unsigned char i = 0; i < FS_NR_FILE_HANDLES; i++)
   {
-    flashstore_compact(item[sizeof(unsigned short)], heap, sp);
-    ret = flashstore_addspecial(item);
+    if (files[i].filename == filename && !file_flush(&files[i], FILE_FLUSH_COMPACT))
+    {
+      ret = 0;
+    }
   }
-  SEMAPHORE_FLASH_SIGNAL();
   return ret;
 }
 
+static unsigned char file_close(os_file_t* file)
+{
+  unsigned char ret = file_flush(file, FILE_FLUSH_COMPACT);
+#if FS_WRITE_BUFFER
+  if (file->wbuf)
+  {
+    OS_free(file->wbuf);
+    file->wbuf = NULL;
+  }
+  if (file->cbuf)
+  {
+    OS_free(file->cbuf);
+    file->cbuf = NULL;
+  }
+  file->cblock = NULL;
+#endif
+  file->action = 0;
+  return ret;
+}
+
+#if FS_WRITE_BUFFER
+//
+// After a write of the buffer failed, keep what is left to write. Records go
+// in one by one when they don't fit together, so those before the one which
+// failed are in the flash already.
+//
+static void file_unbuffer(os_file_t* file)
+{
+  unsigned char pos;
+  unsigned char len;
+  for (pos = 0; pos < file->wlen; pos += len)
+  {
+    len = FLASHSTORE_PADDEDSIZE(file->wbuf[pos + FLASHSPECIAL_DATA_LEN]);
+    unsigned char* item = flashstore_findspecial(*(unsigned long*)&file->wbuf[pos + FLASHSPECIAL_ITEM_ID]);
+    if (!item || !OS_memequal(item, file->wbuf + pos, file->wbuf[pos + FLASHSPECIAL_DATA_LEN]))
+    {
+      break;
+    }
+  }
+  if (pos)
+  {
+    file->wlen -= pos;
+    OS_memcpy(file->wbuf, file->wbuf + pos, file->wlen);
+  }
+}
+
+static unsigned char file_buffered(os_file_t* file, unsigned long id)
+{
+  for (unsigned char pos = 0; pos < file->wlen; pos += FLASHSTORE_PADDEDSIZE(file->wbuf[pos + FLASHSPECIAL_DATA_LEN]))
+  {
+    if (*(unsigned long*)&file->wbuf[pos + FLASHSPECIAL_ITEM_ID] == id)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//
+// The write buffer timeout has passed: flush all the files, unless the
+// interpreter is in the middle of a statement and wants asking again later.
+// Records which could not be written stay buffered, and are tried again
+// after another timeout, or by the next statement to write the file.
+//
+unsigned char interpreter_flush_files(void)
+{
+  if (interpreter_running)
+  {
+    return 1;
+  }
+  for (unsigned char i = 0; i < FS_NR_FILE_HANDLES; i++)
+  {
+    if (!file_flush(&files[i], FILE_FLUSH_COMPACT))
+    {
+      OS_flashstore_flush_after(FS_WRITE_TIMEOUT);
+    }
+  }
+  return 0;
+}
+#endif
+
+#if ENABLE_EXPORT
+//
+// Log export. A range of a file's records is streamed straight out of the
+// flashstore, each record as its length and then its bytes, and EXPORT_END
+// after the last. A chained record's length is EXPORT_LONG and two bytes.
+// A TIME file's records start with their time, as they are in the flash.
+// The stream is read in chunks of whatever size the reader can take, and a
+// chunk which could not be sent is read again after a rewind.
+//
+#define EXPORT_END  0xFF  // longer than any item's record
+#define EXPORT_LONG 0xFE
+static struct
+{
+  os_file_t file;         // the next record to send, poffset below the data while its length goes
+  unsigned short left;    // records still to send
+  unsigned short mrecord; // where the last chunk started
+  unsigned char mpoffset;
+  unsigned char mpart;
+  unsigned short mleft;
+  unsigned char maction;
+} exporter;
+
+//
+// Export count records of the file starting at the record, or up to the first
+// missing one when count is 0. Any export going on is stopped, and a filename
+// which isn't a letter only stops it.
+//
+unsigned char interpreter_export(unsigned char filename, unsigned short record, unsigned short count)
+{
+  os_file_t* file = &exporter.file;
+  file_close(file);
+  exporter.maction = 0;
+  if (filename < 'A' || filename > 'Z')
+  {
+    return 0;
+  }
+  // Buffered records are written out first, unless a statement is busy with them
+  if (!interpreter_running)
+  {
+    file_sync(filename);
+  }
+  unsigned char* meta = flashstore_findspecial(FS_MAKE_META_SPECIAL(filename));
+  file->filename = filename;
+  file->modulo = meta ? *(unsigned short*)&meta[FS_META_MODULO] : FLASHSPECIAL_NR_FILE_RECORDS;
+  file->record = record % file->modulo;
+  file->poffset = 0;
+  file->part = 0;
+#if FS_WRITE_BUFFER
+  if (file_packed(meta) && !(file->cbuf = OS_malloc(FS_CODEC_BUF)))
+  {
+    return 0;
+  }
+#endif
+  exporter.left = count && count < file->modulo ? count : file->modulo;
+  file->action = 'R';
+  return 1;
+}
+
+// Whether there is more of the stream to read
+unsigned char interpreter_export_more(void)
+{
+  return exporter.file.action;
+}
+
+//
+// Read the next chunk of the stream into buf, as much as fits in max bytes.
+// Returns its length, 0 once the stream has ended.
+//
+unsigned char interpreter_export_read(unsigned char* buf, unsigned char max)
+{
+  os_file_t* file = &exporter.file;
+  unsigned char len = 0;
+  exporter.mrecord = file->record;
+  exporter.mpoffset = file->poffset;
+  exporter.mpart = file->part;
+  exporter.mleft = exporter.left;
+  exporter.maction = file->action;
+  while (file->action && len < max)
+  {
+    unsigned char* item = exporter.left ? file_item(file) : NULL;
+    if (!item)
+    {
+      buf[len++] = EXPORT_END;
+      file->action = 0;
+      break;
+    }
+    if (file->poffset < FLASHSPECIAL_DATA_OFFSET)
+    {
+      // The length, a byte at a time
+      unsigned short size = item[FLASHSPECIAL_DATA_LEN] - FLASHSPECIAL_DATA_OFFSET;
+      for (unsigned char part = 1, *next = item; (next = file_nextpart(file, next, part)); part++)
+      {
+        size += next[FLASHSPECIAL_DATA_LEN] - FLASHSPECIAL_DATA_OFFSET;
+      }
+      if (size < EXPORT_LONG)
+      {
+        buf[len++] = size;
+        file->poffset = FLASHSPECIAL_DATA_OFFSET;
+      }
+      else
+      {
+        buf[len++] = file->poffset ? size >> (file->poffset - 1) * 8 : EXPORT_LONG;
+        file->poffset = file->poffset == 2 ? FLASHSPECIAL_DATA_OFFSET : file->poffset + 1;
+      }
+      continue;
+    }
+    unsigned char n = item[FLASHSPECIAL_DATA_LEN] - file->poffset;
+    if (n > max - len)
+    {
+      n = max - len;
+    }
+    OS_memcpy(buf + len, item + file->poffset, n);
+    len += n;
+    file->poffset += n;
+    if (file->poffset == item[FLASHSPECIAL_DATA_LEN])
+    {
+      if (file_nextpart(file, item, file->part + 1))
+      {
+        file->part++;
+        file->poffset = FLASHSPECIAL_DATA_OFFSET;
+      }
+      else
+      {
+        file->record = (file->record + 1) % file->modulo;
+        file->part = 0;
+        file->poffset = 0;
+        exporter.left--;
+      }
+    }
+  }
+  return len;
+}
+
+// Go back to the start of the chunk read last, which could not be sent
+void interpreter_export_rewind(void)
+{
+  exporter.file.record = exporter.mrecord;
+  exporter.file.poffset = exporter.mpoffset;
+  exporter.file.part = exporter.mpart;
+  exporter.left = exporter.mleft;
+  exporter.file.action = exporter.maction;
+}
+#endif
+
 //
 // Build a new BLE service and register it with the system
 //
@@ -6381,11 +8810,11 @@ static unsigned short ble_max_offset(gatt_variable_ref* vref, unsigned short off
 
   get_variable_frame(vref->var, &frame);
 
-  if (frame->type == VAR_DIM_BYTE)
+  if (frame->type != VAR_INT)
   {
-    if (moffset > frame->header.frame_size - sizeof(variable_frame))
+    if (moffset > VAR_DIM_SIZE(frame))
     {
-      moffset = frame->header.frame_size - sizeof(variable_frame);
+      moffset = VAR_DIM_SIZE(frame);
     }
   }
   else
@@ -6435,15 +8864,15 @@ static unsigned char ble_read_callback(unsigned short handle, gattAttribute_t* a
   if (vref->read && offset == 0)
   {
     SEMAPHORE_READ_WAIT();
-    interpreter_run(vref->read, INTERPRETER_CAN_RETURN);
+    interpreter_run(vref->read, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_ONREAD));
   }
 
   v = get_variable_frame(vref->var, &frame);
 #ifdef TARGET_CC254X
-  if (frame->type == VAR_DIM_BYTE)
+  if (frame->type != VAR_INT)
   {
     OS_memcpy(value, v + offset, moffset - offset);
-    unsigned char var_len = frame->header.frame_size - sizeof(variable_frame);
+    unsigned char var_len = VAR_DIM_SIZE(frame);
     // when the DIM array is larger than 20 bytes (max payload)
     // the read CB will be called with increasing offset until all data is transported
     // block the interpreter until all data has been transported
@@ -6496,6 +8925,10 @@ static unsigned char ble_write_callback(unsigned short handle, gattAttribute_t*
   }
   
   v = get_variable_frame(vref->var, &frame);
+  if (frame->type == VAR_DIM_MAP)
+  {
+    return FAILURE;
+  }
 
 #ifdef TARGET_CC254X
   if (frame->type == VAR_DIM_BYTE)
@@ -6515,7 +8948,7 @@ static unsigned char ble_write_callback(unsigned short handle, gattAttribute_t*
   
   if (vref->write)
   {
-    interpreter_run(vref->write, INTERPRETER_CAN_RETURN);
+    interpreter_run(vref->write, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_ONWRITE));
   }
 
   if (attr[1].type.uuid == ble_client_characteristic_config_uuid)
@@ -6604,7 +9037,7 @@ void ble_connection_status(unsigned short connHandle, unsigned char changeType,
         {
           VARIABLE_INT_SET('V', rssi);
         }
-        interpreter_run(vframe->connect, INTERPRETER_CAN_RETURN);
+        interpreter_run(vframe->connect, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_ONCONNECT));
       }
 #endif
       if (changeType == LINKDB_STATUS_UPDATE_REMOVED || (changeType == LINKDB_STATUS_UPDATE_STATEFLAGS && !linkDB_Up(connHandle)))
@@ -6632,7 +9065,7 @@ extern void interpreter_devicefound(unsigned char addtype, unsigned char* addres
     create_dim('V', len, data);
     if (!error_num)
     {
-      interpreter_run(blueBasic_discover.linenum, INTERPRETER_CAN_RETURN);
+      interpreter_run(blueBasic_discover.linenum, INTERPRETER_CAN_RETURN | INTERPRETER_SOURCE(SLICE_ONDISCOVER));
     }
     sp = osp;
   }
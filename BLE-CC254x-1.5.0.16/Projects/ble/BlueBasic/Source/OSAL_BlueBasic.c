@@ -105,7 +105,8 @@ const pTaskEventHandlerFn tasksArr[] =
   GAPBondMgr_ProcessEvent,                                          // task 10
 #endif
   GATTServApp_ProcessEvent,                                         // task 11
-  BlueBasic_ProcessEvent                                            // task 12
+  BlueBasic_ProcessEvent,                                           // task 12
+  BlueBasic_FlashstoreProcessEvent                                  // task 13
 };
 
 const uint8 tasksCnt = sizeof( tasksArr ) / sizeof( tasksArr[0] );
@@ -173,7 +174,10 @@ void osalInitTasks( void )
   GATTServApp_Init( taskID++ );
 
   /* Application */
-  BlueBasic_Init( taskID );
+  BlueBasic_Init( taskID++ );
+
+  /* Background flash compaction, lowest priority */
+  BlueBasic_FlashstoreInit( taskID );
 }
 
 /*********************************************************************
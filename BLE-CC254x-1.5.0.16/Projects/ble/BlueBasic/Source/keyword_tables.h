@@ -13,6 +13,7 @@ static const unsigned char keywords_0[] =
   'A','V','D','D',KW_CONSTANT,CO_AVDD,
   'N','A','M','E',BLE_NAME,
   'N','E','W',KW_NEW,
+  'N','E','X','T','R','E','C',KW_NEXTREC,
   'N','E','X','T',KW_NEXT,
   'N','O','T','I','F','Y',BLE_NOTIFY,
   'N','O',KW_CONSTANT,CO_NO,
@@ -48,6 +49,7 @@ static const unsigned char keywords_2[] =
   'P','O','W','E','R',KW_CONSTANT,CO_POWER,
   'P','O','W',FUNC_POW,
   'P','R','I','N','T',KW_PRINT,
+  'P','R','O','F','I','L','E',KW_PROFILE,
   'P','U','L','L','D','O','W','N',PM_PULLDOWN,
   'P','U','L','L','U','P',PM_PULLUP,
   'P','U','L','S','E',PM_PULSE,
@@ -57,9 +59,11 @@ static const unsigned char keywords_3[] =
 {
   '*',OP_MUL,
   'D','E','L','A','Y',KW_DELAY,
+  'D','E','L','T','A',FS_DELTA,
   'D','E','T','A','C','H',IN_DETACH,
   'D','E','V','_','A','D','D','R','E','S','S',KW_CONSTANT,CO_DEV_ADDRESS,
   'D','I','M',KW_DIM,
+  'D','U','M','P',PR_DUMP,
   'D','U','P','L','I','C','A','T','E','S',BLE_DUPLICATES,
   '^',OP_XOR,
   0
@@ -89,12 +93,16 @@ static const unsigned char keywords_5[] =
 {
   'F','A','L','L','I','N','G',PM_FALLING,
   'F','A','L','S','E',KW_CONSTANT,CO_FALSE,
+  'F','L','U','S','H',KW_FLUSH,
   'F','O','R',KW_FOR,
+  'F','S','C','K',KW_FSCK,
   'S','C','A','N',KW_SCAN,
+  'S','E','E','K',KW_SEEK,
   'S','E','R','I','A','L',KW_SERIAL,
   'S','E','R','V','I','C','E',BLE_SERVICE,
   'S','L','A','V','E','_','L','A','T','E','N','C','Y',KW_CONSTANT,CO_SLAVE_LATENCY,
   'S','L','A','V','E',SPI_SLAVE,
+  'S','L','I','C','E','S',KW_SLICES,
   'S','P','I',KW_SPI,
   'S','T','E','P',ST_STEP,
   'S','T','O','P',TI_STOP,
@@ -114,6 +122,7 @@ static const unsigned char keywords_6[] =
   'T','I','M','E','O','U','T','_','M','U','L','T','I','P','L','I','E','R',KW_CONSTANT,CO_TIMEOUT_MULTIPLIER,
   'T','I','M','E','O','U','T',PM_TIMEOUT,
   'T','I','M','E','R',KW_TIMER,
+  'T','I','M','E',FS_TIME,
   'T','O',ST_TO,
   'T','R','A','N','S','F','E','R',SPI_TRANSFER,
   'T','R','U','E',KW_CONSTANT,CO_TRUE,
@@ -179,6 +188,7 @@ static const unsigned char keywords_11[] =
 static const unsigned char keywords_12[] =
 {
   '&',OP_AND,
+  'M','A','P',KW_MAP,
   'M','A','S','T','E','R',SPI_MASTER,
   'M','A','X','_','C','O','N','N','_','I','N','T','E','R','V','A','L',KW_CONSTANT,CO_MAX_CONN_INTERVAL,
   'M','E','M',KW_MEM,
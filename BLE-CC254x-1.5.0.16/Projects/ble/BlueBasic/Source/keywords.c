@@ -37,6 +37,8 @@ struct keyword
   { "RND", "FUNC_RND" },
   { "MILLIS", "FUNC_MILLIS" },
   { "BATTERY", "FUNC_BATTERY" },
+  { "POW", "FUNC_POW" },
+  { "TEMP", "FUNC_TEMP" },
   { "AUTORUN", "KW_AUTORUN" },
   { ">=", "OP_GE" },
   { "<>", "OP_NE" },
@@ -117,7 +119,17 @@ struct keyword
   { "CLOSE", "KW_CLOSE" },
   { "TRUNCATE", "FS_TRUNCATE" },
   { "APPEND", "FS_APPEND" },
+  { "DELTA", "FS_DELTA" },
+  { "TIME", "FS_TIME" },
   { "EOF", "FUNC_EOF" },
+  { "PROFILE", "KW_PROFILE" },
+  { "DUMP", "PR_DUMP" },
+  { "SLICES", "KW_SLICES" },
+  { "FLUSH", "KW_FLUSH" },
+  { "FSCK", "KW_FSCK" },
+  { "MAP", "KW_MAP" },
+  { "NEXTREC", "KW_NEXTREC" },
+  { "SEEK", "KW_SEEK" },
   //
   // Constants
   //
@@ -148,6 +160,7 @@ struct keyword
   { "BONDING_ENABLED", "KW_CONSTANT,CO_BONDING_ENABLED" },
 
   { "POWER", "KW_CONSTANT,CO_POWER" },
+  { "AVDD", "KW_CONSTANT,CO_AVDD" },
 };
 
 #define	NR_TABLES	13
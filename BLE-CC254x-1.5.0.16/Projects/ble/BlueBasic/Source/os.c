@@ -346,10 +346,15 @@ void OS_delaymicroseconds(short micros)
 void OS_flashstore_init(void)
 {
   // If flashstore is uninitialized, deleting all the pages will set it up correctly.
-  if (*(unsigned long*)FLASHSTORE_CPU_BASEADDR == 0xFFFFFFFF)
+  // A single erased page is just one caught mid compaction, which flashstore_init recovers.
+  for (unsigned char pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
   {
-    flashstore_deleteall();
+    if (*(unsigned long*)(FLASHSTORE_CPU_BASEADDR + pg * FLASHSTORE_PAGESIZE) != 0xFFFFFFFF)
+    {
+      return;
+    }
   }
+  flashstore_deleteall();
 }
 
 
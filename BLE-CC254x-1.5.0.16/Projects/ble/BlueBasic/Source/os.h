@@ -19,17 +19,23 @@
 #define kMfrName "https://blue-battery.com"
 #endif
 
-#if !__APPLE__
+// Host simulator builds (Xcode on macOS, CMake on Linux)
+#if __APPLE__ || __linux__
+#define OS_HOST 1
+#endif
+
+#if !OS_HOST
 #define int32_t long int  // 32 bit on the IAR EW8051
 #define uint32_t unsigned long int
 #define int16_t short     // 16 bit on the IAR EW8051
 #define uint16_t unsigned short
 #endif
 
-#if __APPLE__
+#if OS_HOST
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <memory.h>
 #include <time.h>
 #include <assert.h>
@@ -45,8 +51,10 @@
 #define SIMULATE_FLASH  1
 
 #define OS_memset(A, B, C)    memset(A, B, C)
-#define OS_memcpy(A, B, C)    memcpy(A, B, C)
+// Like osal_memcpy, return the end of the copied destination
+#define OS_memcpy(A, B, C)    ((unsigned char*)memcpy(A, B, C) + (C))
 #define OS_rmemcpy(A, B, C)   memmove(A, B, C)
+#define OS_memequal(A, B, C)  (!memcmp(A, B, C))
 #define OS_srand(A)           srandom(A)
 #define OS_rand()             random()
 #define OS_malloc(A)          malloc(A)
@@ -69,10 +77,39 @@ extern void OS_flashstore_write(unsigned long faddr, unsigned char* value, unsig
 extern void OS_flashstore_erase(unsigned long page);
 extern void OS_init(void);
 extern uint32_t OS_get_millis(void);
+extern void OS_set_virtual_millis(uint32_t millis);
+extern void OS_timer_dispatch(void);
+extern uint32_t OS_timer_next(void);
+extern void OS_prompt_line(const char* line);
+extern void OS_idle(void);
+
+// Background flash compaction runs from OS_idle(), standing in for its OSAL task
+extern unsigned char OS_flashstore_compact_pending;
+#define OS_flashstore_compact_wake() (OS_flashstore_compact_pending = 1)
+// and so do the file write buffer flushes, when their deadline has passed
+extern uint32_t OS_flashstore_flush_due;
+#define OS_flashstore_flush_after(MS) (OS_flashstore_flush_due = OS_get_millis() + (MS) + 1)
 
 // command line option from main.c
 extern unsigned char flashstore_nrpages;
 
+// Execution counters reported by the bbbench host driver
+#ifdef FEATURE_STATS
+typedef struct
+{
+  unsigned long statements;
+  unsigned long expressions;
+  unsigned long flash_writes;
+  unsigned long flash_erases;
+  unsigned long flash_compacts;   // inline, while a write waits
+  unsigned long compact_steps;    // background
+  unsigned long page_erases[124]; // up to the 124 pages bbbench -p allows
+} os_stats_t;
+extern os_stats_t OS_stats;
+extern unsigned long OS_virtual_statement_micros;
+#define OS_STAT_INC(F)          (OS_stats.F++)
+#endif
+
 #define OS_MAX_TIMER              4
 #define BLUEBASIC_EVENT_TIMER     0x0001
 #define DELAY_TIMER               3
@@ -226,7 +263,7 @@ extern bStatus_t GAP_SetParamValue( gapParamIDs_t paramID, uint16 paramValue );
 #define OS_MAX_SERIAL 2
 #define ENABLE_BLE_CONSOLE      1
 
-#else /* __APPLE__ --------------------------------------------------------------------------- */
+#else /* OS_HOST ------------------------------------------------------------------------------- */
 
 #include "OSAL.h"
 #include "hal_board.h"
@@ -309,6 +346,7 @@ extern bStatus_t GAP_SetParamValue( gapParamIDs_t paramID, uint16 paramValue );
 #endif
 
 extern unsigned char blueBasic_TaskID;
+extern unsigned char blueBasic_FlashstoreTaskID;
 
 __no_init __data uint8 JumpToImageAorB @ 0x09;
 
@@ -342,6 +380,13 @@ __no_init __data uint8 JumpToImageAorB @ 0x09;
 #define OS_AUTORUN_TIMEOUT        5000
 #endif
 
+// Flashstore task events
+#define FLASHSTORE_EVENT_COMPACT  0x0001
+#define FLASHSTORE_EVENT_FLUSH    0x0002
+#define FLASHSTORE_EVENT_EXPORT   0x0004
+#define OS_flashstore_compact_wake() osal_set_event(blueBasic_FlashstoreTaskID, FLASHSTORE_EVENT_COMPACT)
+#define OS_flashstore_flush_after(MS) osal_start_timerEx(blueBasic_FlashstoreTaskID, FLASHSTORE_EVENT_FLUSH, (MS))
+
 #define OS_MAX_FILE               16
 
 #if HAL_UART
@@ -413,6 +458,7 @@ extern unsigned char bluebasic_block_execution;
 
 #define OS_memset(A, B, C)     osal_memset(A, B, C)
 #define OS_memcpy(A, B, C)     osal_memcpy(A, B, C)
+#define OS_memequal(A, B, C)   osal_memcmp(A, B, C)
 #define OS_srand(V)            VOID V
 #define OS_rand()              osal_rand()
 #define OS_malloc(A)           osal_mem_alloc(A)
@@ -470,12 +516,34 @@ extern void OS_enable_sleep(unsigned char enable);
 
 extern void interpreter_devicefound(unsigned char addtype, unsigned char* address, signed char rssi, unsigned char eventtype, unsigned char len, unsigned char* data);
 
-#endif /* __APPLE__ */
+#endif /* OS_HOST */
+
+#ifndef OS_STAT_INC
+#define OS_STAT_INC(F)
+#endif
 
 // bit field for interpreter modes
 #define INTERPRETER_CAN_RETURN 1
 #define INTERPRETER_CAN_YIELD  2
 
+// event source of an interpreter run, kept in the upper bits of the mode
+#define INTERPRETER_SOURCE(S)     ((S) << 2)
+#define INTERPRETER_SOURCE_GET(M) ((M) >> 2)
+enum
+{
+  SLICE_CONSOLE,
+  SLICE_TIMER,  // + timer id
+  SLICE_INTERRUPT = SLICE_TIMER + OS_MAX_TIMER,
+  SLICE_SERIAL,
+  SLICE_I2C,
+  SLICE_ONREAD,
+  SLICE_ONWRITE,
+  SLICE_ONCONNECT,
+  SLICE_ONDISCOVER,
+  SLICE_RESUME, // continues the run which yielded
+  SLICE_SOURCES = SLICE_RESUME
+};
+
 //definitions of field length in bytes to process
 #define _GAP_ARRAY 0x8000
 #define _GAP_NOVAL 0x0000
@@ -555,7 +623,13 @@ extern bool interpreter_setup(void);
 extern void interpreter_banner(void);
 extern void interpreter_loop(void);
 extern unsigned char interpreter_run(unsigned short gofrom, unsigned char canreturn);
+extern unsigned char interpreter_running;
 extern void interpreter_timer_event(unsigned short id);
+extern unsigned char interpreter_flush_files(void);
+extern unsigned char interpreter_export(unsigned char filename, unsigned short record, unsigned short count);
+extern unsigned char interpreter_export_more(void);
+extern unsigned char interpreter_export_read(unsigned char* buf, unsigned char max);
+extern void interpreter_export_rewind(void);
 
 #ifdef FEATURE_SAMPLING
 extern void interpreter_sampling(void);
@@ -571,6 +645,32 @@ extern void interpreter_sampling(void);
 #define FLASHSTORE_PAGESIZE   2048
 #define FLASHSTORE_LEN        (FLASHSTORE_NRPAGES * FLASHSTORE_PAGESIZE)
 
+// Line number lookup cache entries (power of 2, 0 disables the cache)
+#ifndef FLASHSTORE_LINECACHE_SIZE
+#define FLASHSTORE_LINECACHE_SIZE 8
+#endif
+
+// Difference in erases between the most and least worn pages at which the flashstore
+// compacts other pages first and moves static data onto the worn page (0 disables)
+#ifndef FLASHSTORE_WEAR_SPREAD
+#define FLASHSTORE_WEAR_SPREAD 32
+#endif
+
+// Items the background compactor copies per step (0 only compacts when a write fails)
+#ifndef FLASHSTORE_COMPACT_STEP
+#define FLASHSTORE_COMPACT_STEP 4
+#endif
+
+// Invalidated bytes in a page at which the background compactor takes it on
+#ifndef FLASHSTORE_COMPACT_WASTE
+#define FLASHSTORE_COMPACT_WASTE (FLASHSTORE_PAGESIZE / 4 * 3)
+#endif
+
+// Special item directory entries (consecutive ids, 0 disables the directory)
+#ifndef FLASHSTORE_SPECIALDIR_SIZE
+#define FLASHSTORE_SPECIALDIR_SIZE 32
+#endif
+
 enum
 {
   FLASHID_INVALID = 0x0000,
@@ -582,16 +682,86 @@ enum
 {
   FLASHSPECIAL_AUTORUN = 0x00000001,
   FLASHSPECIAL_SNV     = 0x00000100,
+  FLASHSPECIAL_INDEX   = 0x00000200,
+  FLASHSPECIAL_FILEMETA = 0x00000300,
   FLASHSPECIAL_FILE0   = 0x00100000,
   FLASHSPECIAL_FILE25  = 0x00290000,
+  FLASHSPECIAL_BLOCK0  = 0x00500000,
+  FLASHSPECIAL_BLOCK25 = 0x00690000,
+  FLASHSPECIAL_CHAIN0  = 0x00700000,
+  FLASHSPECIAL_CHAIN25 = 0x00890000,
+  FLASHSPECIAL_TIME0   = 0x00A00000,
+  FLASHSPECIAL_TIME25  = 0x00B90000,
 };
 
+// Open file handles, each takes some 40 bytes of RAM
+#ifndef FS_NR_FILE_HANDLES
 #define FS_NR_FILE_HANDLES 4
+#endif
+#if FS_NR_FILE_HANDLES > 255
+#error "File handles are numbered by a byte"
+#endif
+// Longest record WRITE # takes. Records which don't fit in an item are chained over several.
+#ifndef FS_RECORD_MAX
+#define FS_RECORD_MAX 2048
+#endif
+#if FS_RECORD_MAX > 32768
+#error "A chained record has at most 255 parts"
+#endif
+// Bytes of records each file handle collects before writing them to flash in one go (0 disables)
+#ifndef FS_WRITE_BUFFER
+#define FS_WRITE_BUFFER 64
+#endif
+#if FS_WRITE_BUFFER > 232
+#error "FS_WRITE_BUFFER and the file metadata must fit in a special item length"
+#endif
+// Milliseconds buffered records may wait before they are written anyway
+#ifndef FS_WRITE_TIMEOUT
+#define FS_WRITE_TIMEOUT 5000
+#endif
+// A TIME file's index keeps the time of every FS_TIME_STRIDE-th record
+#ifndef FS_TIME_STRIDE
+#define FS_TIME_STRIDE 16
+#endif
+// GATT service streaming a range of a file's records out in notifications (0 disables)
+#ifndef ENABLE_EXPORT
+#define ENABLE_EXPORT 1
+#endif
+#if FS_WRITE_BUFFER
+// DELTA files pack records of up to FS_CODEC_RECORD bytes into blocks of up to FS_CODEC_RUN
+#ifndef FS_CODEC_RECORD
+#define FS_CODEC_RECORD 32
+#endif
+#define FS_CODEC_RUN    32
+// Most bytes a packed record takes: its length, and five bytes a word or two a byte
+#define FS_CODEC_MAXLEN(LEN)  (1 + (LEN) / 4 * 5 + (LEN) % 4 * 2)
+#endif
 #define FS_MAKE_FILE_SPECIAL(NAME,OFF)  (FLASHSPECIAL_FILE0+(((unsigned long)((NAME)-'A'))<<16)|(OFF))
+// A block of packed records, named after the first
+#define FS_MAKE_BLOCK_SPECIAL(NAME,OFF) (FLASHSPECIAL_BLOCK0+(((unsigned long)((NAME)-'A'))<<16)|(OFF))
+// A chained record's parts, the first named after the record and those after it numbered in the top byte.
+// All but the last part are full items.
+#define FS_MAKE_CHAIN_SPECIAL(NAME,OFF,PART) (FLASHSPECIAL_CHAIN0+(((unsigned long)((NAME)-'A'))<<16)|(OFF)|((unsigned long)(PART)<<24))
+#define FS_IS_CHAIN_SPECIAL(ID)     (((ID) & 0x00FF0000) >= FLASHSPECIAL_CHAIN0 && ((ID) & 0x00FF0000) <= FLASHSPECIAL_CHAIN25)
+#define FS_CHAIN_ITEMLEN            0xFC
+// A TIME file's records start with the 32-bit time they were written, and its
+// index has a slot for every FS_TIME_STRIDE records, <time:4> of the first
+#define FS_TIME_LEN                 4
+#define FS_MAKE_TIME_SPECIAL(NAME,SLOT) (FLASHSPECIAL_TIME0+(((unsigned long)((NAME)-'A'))<<16)|(SLOT))
 #define FLASHSPECIAL_NR_FILE_RECORDS 0xFFFF
 #define FLASHSPECIAL_DATA_LEN       2
 #define FLASHSPECIAL_ITEM_ID        3
 #define FLASHSPECIAL_DATA_OFFSET    (FLASHSPECIAL_ITEM_ID + sizeof(unsigned long))
+// File metadata <next:2><count:2><modulo:2><codec:1><timed:1>, written along with the file's records
+#define FS_MAKE_META_SPECIAL(NAME)  (FLASHSPECIAL_FILEMETA + ((NAME) - 'A'))
+#define FS_META_NEXT                FLASHSPECIAL_DATA_OFFSET
+#define FS_META_COUNT               (FS_META_NEXT + sizeof(unsigned short))
+#define FS_META_MODULO              (FS_META_COUNT + sizeof(unsigned short))
+#define FS_META_CODEC               (FS_META_MODULO + sizeof(unsigned short))
+#define FS_META_TIME                (FS_META_CODEC + sizeof(unsigned char))
+#define FS_META_LEN                 (FS_META_TIME + sizeof(unsigned char))
+// Items take whole flash words
+#define FLASHSTORE_PADDEDSIZE(SZ)   (((SZ) + 3) & -4)
 
 #define SNV_MAKE_ID(FILENAME) ((FILENAME) - '0' + BLE_NVID_CUST_START)
 
@@ -601,10 +771,29 @@ extern unsigned char** flashstore_deleteline(unsigned short id);
 extern unsigned char** flashstore_deleteall(void);
 extern unsigned short** flashstore_findclosest(unsigned short id);
 extern unsigned int flashstore_freemem(void);
+extern unsigned short flashstore_fsck(unsigned char* ram, unsigned char* ramend);
+extern unsigned char* flashstore_pack(unsigned char* out, const unsigned char* prev, unsigned char prevlen, const unsigned char* rec, unsigned char len);
+extern const unsigned char* flashstore_unpack(const unsigned char* in, unsigned char* rec, unsigned char* len);
+extern unsigned char flashstore_packcount(const unsigned char* block);
 extern void flashstore_compact(unsigned char asklen, unsigned char* tempmemstart, unsigned char* tempmemend);
 extern unsigned char flashstore_addspecial(unsigned char* item);
+extern unsigned char* flashstore_addspecials(unsigned char* items, unsigned char len);
 extern unsigned char flashstore_deletespecial(unsigned long specialid);
+extern unsigned char flashstore_deletespecialat(unsigned long specialid, unsigned char* ptr, unsigned long stamp);
+extern unsigned long flashstore_stamp(void);
 extern unsigned char* flashstore_findspecial(unsigned long specialid);
+extern void flashstore_checkpoint(void);
+#if FLASHSTORE_COMPACT_STEP
+extern unsigned char flashstore_compact_step(void);
+#endif
+#if FLASHSTORE_LINECACHE_SIZE
+extern unsigned long flashstore_linecache_hits;
+extern unsigned long flashstore_linecache_misses;
+#endif
+#if FLASHSTORE_SPECIALDIR_SIZE
+extern unsigned long flashstore_specialdir_hits;
+extern unsigned long flashstore_specialdir_misses;
+#endif
 
 extern unsigned char OS_serial_open(unsigned char port, unsigned long baud, unsigned char parity, unsigned char bits, unsigned char stop, unsigned char flow, unsigned short onread, unsigned short onwrite);
 extern unsigned char OS_serial_close(unsigned char port);
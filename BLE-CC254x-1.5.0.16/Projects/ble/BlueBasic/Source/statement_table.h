@@ -0,0 +1,70 @@
+//
+// Statement dispatch: STATEMENT(token, label) for every statement keyword.
+// Included by interpreter_run() either as switch cases or as a computed goto table,
+// see FEATURE_COMPUTED_GOTO. Tokens not listed go to 'statement_default'.
+//
+#if ENABLE_BLE_CONSOLE
+STATEMENT(KW_LIST, list)
+#endif
+STATEMENT(KW_MEM, mem)
+STATEMENT(KW_NEW, cmd_new)
+STATEMENT(KW_RUN, cmd_run)
+STATEMENT(KW_NEXT, next)
+STATEMENT(KW_IF, cmd_elif)
+STATEMENT(KW_ELIF, cmd_elif)
+STATEMENT(KW_ELSE, cmd_else)
+STATEMENT(KW_GOTO, cmd_goto)
+STATEMENT(KW_GOSUB, cmd_gosub)
+STATEMENT(KW_RETURN, gosub_return)
+STATEMENT(KW_REM, run_next_statement)
+STATEMENT(KW_SLASHSLASH, run_next_statement)
+STATEMENT(KW_FOR, forloop)
+STATEMENT(KW_PRINT, print)
+STATEMENT(KW_REBOOT, cmd_reboot)
+STATEMENT(KW_END, run_next_statement)
+STATEMENT(KW_DIM, cmd_dim)
+STATEMENT(KW_TIMER, cmd_timer)
+STATEMENT(KW_DELAY, cmd_delay)
+STATEMENT(KW_AUTORUN, cmd_autorun)
+#ifdef ENABLE_PORT0
+STATEMENT(KW_PIN_P0, cmd_pin)
+#endif
+#ifdef ENABLE_PORT1
+STATEMENT(KW_PIN_P1, cmd_pin)
+#endif
+#ifdef ENABLE_PORT2
+STATEMENT(KW_PIN_P2, cmd_pin)
+#endif
+STATEMENT(KW_GATT, ble_gatt)
+STATEMENT(KW_ADVERT, cmd_advert)
+STATEMENT(KW_SCAN, cmd_scan)
+STATEMENT(KW_BTPOKE, cmd_btpoke)
+STATEMENT(KW_PINMODE, cmd_pinmode)
+STATEMENT(KW_INTERRUPT, cmd_interrupt)
+STATEMENT(KW_SERIAL, cmd_serial)
+#if !defined(ENABLE_SPI) || ENABLE_SPI
+STATEMENT(KW_SPI, cmd_spi)
+#endif
+STATEMENT(KW_ANALOG, cmd_analog)
+STATEMENT(KW_CONFIG, cmd_config)
+#if !defined(ENABLE_WIRE) || ENABLE_WIRE
+STATEMENT(KW_WIRE, cmd_wire)
+#endif
+#if HAL_I2C
+STATEMENT(KW_I2C, cmd_i2c)
+#endif
+STATEMENT(KW_OPEN, cmd_open)
+STATEMENT(KW_CLOSE, cmd_close)
+STATEMENT(KW_READ, cmd_read)
+STATEMENT(KW_WRITE, cmd_write)
+STATEMENT(KW_FLUSH, cmd_flush)
+STATEMENT(KW_FSCK, cmd_fsck)
+STATEMENT(KW_MAP, cmd_map)
+STATEMENT(KW_NEXTREC, cmd_nextrec)
+STATEMENT(KW_SEEK, cmd_seek)
+#if FEATURE_PROFILE
+STATEMENT(KW_PROFILE, cmd_profile)
+#endif
+#if FEATURE_SLICE_STATS
+STATEMENT(KW_SLICES, cmd_slices)
+#endif
@@ -0,0 +1,197 @@
+//
+//  bbbench.c
+//  BlueBasic
+//
+//  Deterministic benchmark driver for the host build.
+//  Loads a .bbasic program into the simulated flashstore, RUNs it under a
+//  virtual clock (timers fire in simulated time, not via ualarm) and reports
+//  interpreter throughput.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "os.h"
+
+extern bool interpreter_setup(void);
+
+char *flash_file = NULL; // keep the flashstore in memory only
+unsigned char flashstore_nrpages = 8;
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "Usage: %s [-n runs] [-t millis] [-s micros] [-p pages] [-e] [-q] program.bbasic\n"
+          "  -n runs:   number of times to RUN the program (default 1)\n"
+          "  -t millis: virtual time each run may use for timers (default 10000)\n"
+          "  -s micros: virtual time each statement takes (default 0)\n"
+          "  -p pages:  number of flash pages to use (default 8)\n"
+          "  -e:        report the flash erases of every page\n"
+          "  -q:        suppress program output\n",
+          name);
+  exit(1);
+}
+
+static double wall_seconds(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//
+// Print the erase count of every page as a histogram, to show how evenly
+// the flashstore wears the flash.
+//
+static void erase_histogram(FILE* report)
+{
+  unsigned long min = ~0UL;
+  unsigned long max = 0;
+  for (unsigned char pg = 0; pg < flashstore_nrpages; pg++)
+  {
+    unsigned long erases = OS_stats.page_erases[pg];
+    min = erases < min ? erases : min;
+    max = erases > max ? erases : max;
+  }
+  fprintf(report, "page erases:  min %lu max %lu\n", min, max);
+  for (unsigned char pg = 0; pg < flashstore_nrpages; pg++)
+  {
+    unsigned long erases = OS_stats.page_erases[pg];
+    int bar = max ? (int)(erases * 50 / max) : 0;
+    fprintf(report, "  %3u %8lu ", pg, erases);
+    while (bar--)
+    {
+      fputc('#', report);
+    }
+    fputc('\n', report);
+  }
+}
+
+static void enter(const char* line)
+{
+  OS_prompt_line(line);
+  interpreter_run(0, 0);
+}
+
+int main(int argc, char * const argv[])
+{
+  unsigned long runs = 1;
+  uint32_t limit = 10000;
+  int quiet = 0;
+  int erases = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:t:s:p:eq")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        runs = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        limit = (uint32_t)strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        OS_virtual_statement_micros = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        opt = atoi(optarg);
+        if (opt < 1 || opt > 124)
+        {
+          usage(argv[0]);
+        }
+        flashstore_nrpages = opt;
+        break;
+      case 'e':
+        erases = 1;
+        break;
+      case 'q':
+        quiet = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || runs == 0)
+  {
+    usage(argv[0]);
+  }
+
+  FILE* program = fopen(argv[optind], "r");
+  if (!program)
+  {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  // Keep the report on the real stdout even when program output is discarded
+  FILE* report = fdopen(dup(fileno(stdout)), "w");
+  if (quiet)
+  {
+    freopen("/dev/null", "w", stdout);
+  }
+
+  OS_set_virtual_millis(0);
+  interpreter_setup();
+  enter("NEW");
+
+  char line[256];
+  while (fgets(line, sizeof(line), program))
+  {
+    if (line[0] != '\n' && line[0] != '\r')
+    {
+      enter(line);
+    }
+  }
+  fclose(program);
+
+  memset(&OS_stats, 0, sizeof(OS_stats));
+  double start = wall_seconds();
+  for (unsigned long run = 0; run < runs; run++)
+  {
+    uint32_t next;
+
+    OS_set_virtual_millis(0);
+    enter("RUN");
+    OS_idle();
+    while ((next = OS_timer_next()) && next <= limit)
+    {
+      // Timers which fell due while statements took time run late
+      OS_set_virtual_millis(next > OS_get_millis() ? next : OS_get_millis());
+      OS_timer_dispatch();
+      OS_idle();
+    }
+    for (unsigned char id = 0; id < OS_MAX_TIMER; id++)
+    {
+      OS_timer_stop(id);
+    }
+  }
+  double elapsed = wall_seconds() - start;
+  fflush(stdout);
+
+  if (elapsed <= 0)
+  {
+    elapsed = 1e-9;
+  }
+  fprintf(report,
+          "program:      %s\n"
+          "runs:         %lu\n"
+          "wall time:    %.3f s\n"
+          "statements:   %lu (%.0f/s)\n"
+          "expressions:  %lu (%.0f/s)\n"
+          "flash writes: %lu\n"
+          "flash erases: %lu\n"
+          "compactions:  %lu inline, %lu background steps\n",
+          argv[optind], runs, elapsed,
+          OS_stats.statements, OS_stats.statements / elapsed,
+          OS_stats.expressions, OS_stats.expressions / elapsed,
+          OS_stats.flash_writes, OS_stats.flash_erases,
+          OS_stats.flash_compacts, OS_stats.compact_steps);
+  if (erases)
+  {
+    erase_histogram(report);
+  }
+  fclose(report);
+
+  return 0;
+}
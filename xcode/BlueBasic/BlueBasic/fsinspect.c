@@ -0,0 +1,100 @@
+//
+//  fsinspect.c
+//  BlueBasic
+//
+//  Flashstore image inspector for the host build.
+//  Loads a flashstore image, as saved by the simulator or read out of a device,
+//  and prints the same report as FSCK plus any consistency errors. The image
+//  is only read, never recovered or compacted, so it shows the store as it was.
+//  With -x it prints the stream the export service would notify for a file
+//  instead, one notification per line.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "os.h"
+
+char *flash_file;
+unsigned char flashstore_nrpages;
+
+// Payload of a notification at the default ATT MTU
+#define EXPORT_CHUNK 20
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "Usage: %s [-x file[,first[,count]]] flashstore\n"
+          "  -x: print the export stream of the file's records\n",
+          name);
+  exit(2);
+}
+
+static int export(const char* range)
+{
+  unsigned int first = 0;
+  unsigned int count = 0;
+  unsigned char chunk[EXPORT_CHUNK];
+
+  sscanf(range + 1, ",%u,%u", &first, &count);
+  if (!interpreter_export(range[0], first, count))
+  {
+    fprintf(stderr, "%s: not a file\n", range);
+    return 1;
+  }
+  while (interpreter_export_more())
+  {
+    unsigned char len = interpreter_export_read(chunk, sizeof(chunk));
+    for (unsigned char i = 0; i < len; i++)
+    {
+      printf(i ? " %02X" : "%02X", chunk[i]);
+    }
+    printf("\n");
+  }
+  interpreter_export(0, 0, 0);
+  return 0;
+}
+
+int main(int argc, char * const argv[])
+{
+  struct stat st;
+  const char* range = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "x:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'x':
+        range = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+  {
+    usage(argv[0]);
+  }
+  // The image holds whole pages, which tell how many there are
+  if (stat(argv[optind], &st) || st.st_size % FLASHSTORE_PAGESIZE ||
+      st.st_size < FLASHSTORE_PAGESIZE || st.st_size > 124 * FLASHSTORE_PAGESIZE)
+  {
+    fprintf(stderr, "%s: not a flashstore image\n", argv[optind]);
+    return 2;
+  }
+  flashstore_nrpages = st.st_size / FLASHSTORE_PAGESIZE;
+  flash_file = (char*)argv[optind];
+  OS_flashstore_init();
+
+  // Room for the bitmap of every line number, or the index of every line
+  static unsigned char ram[0x10000 / 8];
+  if (range)
+  {
+    // Index the image held in memory, leaving the file as it is
+    flash_file = NULL;
+    flashstore_init((unsigned char**)ram);
+    return export(range);
+  }
+  return flashstore_fsck(ram, ram + sizeof(ram)) ? 1 : 0;
+}
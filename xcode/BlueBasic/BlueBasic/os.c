@@ -31,20 +31,134 @@ static char alarmfire;
 static char alarm_active = 0;
 static unsigned char* bstart;
 static unsigned char* bend;
+static unsigned char* bptr;
+static char bquote;
+
+// Virtual clock for bbbench: time only moves when OS_set_virtual_millis() is called
+unsigned char OS_virtual_clock;
+static uint32_t virtual_millis;
+
+#ifdef FEATURE_STATS
+os_stats_t OS_stats;
+// Virtual time each statement takes, so runs have a length on the virtual clock
+unsigned long OS_virtual_statement_micros;
+static unsigned long virtual_statements;
+#endif
 
 extern unsigned char __store[];
 
+unsigned char OS_flashstore_compact_pending;
+uint32_t OS_flashstore_flush_due;
+
+// Background work the OSAL idle task does on the device
+void OS_idle(void)
+{
+#if FLASHSTORE_COMPACT_STEP
+  while (OS_flashstore_compact_pending && !interpreter_running)
+  {
+    OS_flashstore_compact_pending = flashstore_compact_step();
+  }
+#endif
+#if FS_WRITE_BUFFER
+  if (OS_flashstore_flush_due && OS_get_millis() >= OS_flashstore_flush_due)
+  {
+    // Ask again if the interpreter was busy, the flush may also set a new time
+    OS_flashstore_flush_due = 0;
+    if (interpreter_flush_files())
+    {
+      OS_flashstore_flush_after(0);
+    }
+  }
+#endif
+}
+
 void OS_prompt_buffer(unsigned char* start, unsigned char* end)
 {
   bstart = start;
   bend = end;
 }
 
+// Run any timers which are due
+void OS_timer_dispatch(void)
+{
+  uint32_t millis = OS_get_millis();
+  //printf("tick %d\n", millis);
+  for (unsigned char id = 0; id < OS_MAX_TIMER; id++)
+  {
+    if ((timers[id].lineno != 0) && (timers[id].fireTime <= millis))
+    {
+      printf("run timer %d:  millis=%d, fireTime=%d, periode=%d, repeat=%d \n", id, millis, timers[id].fireTime, timers[id].periode, timers[id].repeat);
+      unsigned short lineno = timers[id].lineno;
+      if (id != DELAY_TIMER && timers[id].repeat)
+      {
+        timers[id].fireTime += timers[id].periode;
+      }
+      else
+      {
+        timers[id].lineno = 0;
+      }
+      interpreter_run(lineno, INTERPRETER_SOURCE(SLICE_TIMER + id) | (id == DELAY_TIMER ? 0 : INTERPRETER_CAN_YIELD | INTERPRETER_CAN_RETURN));
+    }
+  }
+}
+
+// Return the fire time of the next pending timer, or 0 if there is none
+uint32_t OS_timer_next(void)
+{
+  uint32_t next = 0;
+  for (unsigned char id = 0; id < OS_MAX_TIMER; id++)
+  {
+    if (timers[id].lineno != 0 && (next == 0 || timers[id].fireTime < next))
+    {
+      next = timers[id].fireTime ? timers[id].fireTime : 1;
+    }
+  }
+  return next;
+}
+
+// Add a character to the prompt buffer as if it was typed
+static unsigned char prompt_type(char c)
+{
+  switch (c)
+  {
+    case '\n':
+      OS_timer_stop(DELAY_TIMER); // Stop autorun
+      OS_putchar('\n');
+      *bptr = '\n';
+      return 1;
+    default:
+      if(bptr == bend)
+      {
+        OS_putchar('\b');
+      }
+      else
+      {
+        // Are we in a quoted string?
+        if(c == bquote)
+        {
+          bquote = 0;
+        }
+        else if (c == '"' || c == '\'')
+        {
+          bquote = c;
+        }
+        else if (bquote == 0 && c >= 'a' && c <= 'z')
+        {
+          c = c + 'A' - 'a';
+        }
+        *bptr++ = c;
+        OS_putchar(c);
+      }
+      return 0;
+  }
+}
+
 char OS_prompt_available(void)
 {
-  char quote = 0;
-  unsigned char* ptr = bstart;
+  bquote = 0;
+  bptr = bstart;
 
+  OS_idle();
   for (;;)
   {
     char c = getchar();
@@ -58,62 +172,34 @@ char OS_prompt_available(void)
         if (alarmfire)
         {
           //alarmfire = 0;
-          uint32_t millis = OS_get_millis();
-          //printf("tick %d\n", millis);
-          for (unsigned char id = 0; id < OS_MAX_TIMER; id++)
-          {
-            if ((timers[id].lineno != 0) && (timers[id].fireTime <= millis))
-            {
-              printf("run timer %d:  millis=%d, fireTime=%d, periode=%d, repeat=%d \n", id, millis, timers[id].fireTime, timers[id].periode, timers[id].repeat);
-              unsigned short lineno = timers[id].lineno;
-              if (id != DELAY_TIMER && timers[id].repeat)
-              {
-                timers[id].fireTime += timers[id].periode;
-              }
-              else
-              {
-                timers[id].lineno = 0;
-              }
-              interpreter_run(lineno, id == DELAY_TIMER ? 0 : INTERPRETER_CAN_YIELD | INTERPRETER_CAN_RETURN);
-            }
-          }
+          OS_timer_dispatch();
+          OS_idle();
 //          timers[0].lineno && interpreter_run(timers[0].lineno, 1);
 //          timers[1].lineno && interpreter_run(timers[1].lineno, 0);
         }
         break;
-      case '\n':
-        OS_timer_stop(DELAY_TIMER); // Stop autorun
-        OS_putchar('\n');
-        *ptr = '\n';
-        return 1;
       default:
-        if(ptr == bend)
+        if (prompt_type(c))
         {
-          OS_putchar('\b');
-        }
-        else
-        {
-          // Are we in a quoted string?
-          if(c == quote)
-          {
-            quote = 0;
-          }
-          else if (c == '"' || c == '\'')
-          {
-            quote = c;
-          }
-          else if (quote == 0 && c >= 'a' && c <= 'z')
-          {
-            c = c + 'A' - 'a';
-          }
-          *ptr++ = c;
-          OS_putchar(c);
+          return 1;
         }
         break;
     }
   }
 }
 
+// Enter a complete line into the prompt buffer (used by bbbench)
+void OS_prompt_line(const char* line)
+{
+  bquote = 0;
+  bptr = bstart;
+  while (*line && *line != '\n' && *line != '\r')
+  {
+    prompt_type(*line++);
+  }
+  prompt_type('\n');
+}
+
 static void alarmhandler(int sig)
 {
   alarmfire = 1;
@@ -153,10 +239,12 @@ char OS_timer_start(unsigned char id, unsigned long timeout, unsigned char repea
   timers[id].fireTime = OS_get_millis() + (int32_t) timeout;
   //ualarm((useconds_t)(timeout * 1000), repeat ? (useconds_t)(timeout * 1000) : 0);
   // schedule a alam evry 1 us
-  if (alarm_active == 0)
+  if (alarm_active == 0 && !OS_virtual_clock)
   {
     alarm_active = 1;
-    struct sigaction act = { alarmhandler, 0, 0 };
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = alarmhandler;
     sigaction(SIGALRM, &act, NULL);
     ualarm((useconds_t)(1000), (useconds_t)(1000));
   }
@@ -262,20 +350,28 @@ extern bStatus_t GAP_SetParamValue( gapParamIDs_t paramID, uint16 paramValue )
 
 void OS_flashstore_init(void)
 {
-  FILE* fp = fopen(flash_file, "r");
+  static unsigned char formatted;
+  FILE* fp = flash_file ? fopen(flash_file, "r") : NULL;
   if (fp)
   {
     fread(__store, FLASHSTORE_LEN, sizeof(char), fp);
     fclose(fp);
+    formatted = 1;
   }
-  else
+  else if (!formatted || flash_file)
   {
+    // Without a file the store only lives in memory, so keep it when the
+    // flashstore is rebuilt after compacting
+    formatted = 1;
     int lastage = 1;
-    const unsigned char* ptr;
+    unsigned char* ptr;
     memset(__store, 0xFF, FLASHSTORE_LEN);
     for (ptr = __store; ptr < &__store[FLASHSTORE_LEN]; ptr += FLASHSTORE_PAGESIZE)
     {
+      // <age:4><erases:2><format:1>, see BlueBasic_Flashstore.c
       *(int*)ptr = lastage++;
+      *(unsigned short*)(ptr + 4) = 0;
+      ptr[6] = 0;
     }
     
   }
@@ -284,17 +380,26 @@ void OS_flashstore_init(void)
 void OS_flashstore_write(unsigned long faddr, unsigned char* value, unsigned short sizeinwords)
 {
   memcpy(&__store[faddr << 2], value, sizeinwords << 2);
-  FILE* fp = fopen(flash_file, "w");
-  fwrite(__store, FLASHSTORE_LEN, sizeof(char), fp);
-  fclose(fp);
+  OS_STAT_INC(flash_writes);
+  if (flash_file)
+  {
+    FILE* fp = fopen(flash_file, "w");
+    fwrite(__store, FLASHSTORE_LEN, sizeof(char), fp);
+    fclose(fp);
+  }
 }
 
 void OS_flashstore_erase(unsigned long page)
 {
   memset(&__store[page << 11], 0xFF, FLASHSTORE_PAGESIZE);
-  FILE* fp = fopen(flash_file, "w");
-  fwrite(__store, FLASHSTORE_LEN, sizeof(char), fp);
-  fclose(fp);
+  OS_STAT_INC(flash_erases);
+  OS_STAT_INC(page_erases[page]);
+  if (flash_file)
+  {
+    FILE* fp = fopen(flash_file, "w");
+    fwrite(__store, FLASHSTORE_LEN, sizeof(char), fp);
+    fclose(fp);
+  }
 }
 
 unsigned char OS_serial_open(unsigned char port, unsigned long baud, unsigned char parity, unsigned char bits, unsigned char stop, unsigned char flow, unsigned short onread, unsigned short onwrite)
@@ -328,6 +433,13 @@ int16 OS_get_temperature(uint8 wait) {
 
 uint32_t OS_get_millis(void) {
   static uint32_t start_millis = 0xffffffff;
+  if (OS_virtual_clock) {
+#ifdef FEATURE_STATS
+    return virtual_millis + (uint32_t)((OS_stats.statements - virtual_statements) * OS_virtual_statement_micros / 1000);
+#else
+    return virtual_millis;
+#endif
+  }
   struct timespec t;
   clock_gettime(CLOCK_MONOTONIC, &t);
   uint32_t millis = (uint32_t)(t.tv_sec * 1000 + t.tv_nsec / 1000 / 1000);
@@ -337,6 +449,14 @@ uint32_t OS_get_millis(void) {
   return millis - start_millis;
 }
 
+void OS_set_virtual_millis(uint32_t millis) {
+  OS_virtual_clock = 1;
+  virtual_millis = millis;
+#ifdef FEATURE_STATS
+  virtual_statements = OS_stats.statements;
+#endif
+}
+
 void OS_init(void) {
   // initialize start time
   OS_get_millis();
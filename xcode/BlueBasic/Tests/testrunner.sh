@@ -1,4 +1,4 @@
-#!/bin/sh
+#!/bin/bash
 
 #  testrunner.sh
 #  BlueBasic
@@ -6,9 +6,15 @@
 #  Created by tim on 7/15/14.
 #  Copyright (c) 2014 tim. All rights reserved.
 
-BLUEBASIC="$HOME/Library/Developer/Xcode/DerivedData/BlueBasic-d*/Build/Products/Release/BlueBasic"
+#  Usage: testrunner.sh [test ...]
+#  Runs the given tests, or all tests listed in 'tests'. The interpreter binary
+#  and flashstore file can be overridden with $BLUEBASIC and $FLASHSTORE.
 
-for test in $(cat tests)
+BLUEBASIC=${BLUEBASIC:-$HOME/Library/Developer/Xcode/DerivedData/BlueBasic-d*/Build/Products/Release/BlueBasic}
+FLASHSTORE=${FLASHSTORE:-/tmp/flashstore}
+
+cd "$(dirname "$0")"
+for test in ${@:-$(cat tests)}
 do
 if [[ "$test" != !* ]]; then
     exec < $test.test
@@ -26,8 +32,8 @@ $line"
       fi
     done
     expected=${expected:1} # remove first newline
-    rm -f /tmp/flashstore
-    result=$(echo "${input:1}" | $BLUEBASIC | sed '1,4d') # remove startup header
+    rm -f $FLASHSTORE
+    result=$(echo "${input:1}" | $BLUEBASIC $FLASHSTORE | sed '1,4d') # remove startup header
     if [ "$result" = "$expected" ]
     then
       echo "** $test: SUCCESS"